@@ -29,161 +29,639 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "usrp_source.h"
 #include "circular_buffer.h"
 #include "fcch_detector.h"
+#include "fcch_batch.h"
+#include "sch_detector.h"
 #include "arfcn_freq.h"
+#include "coarse_detect.h"
+#include "kernels.h"
+#include "power_sum.h"
+#include "soa_buffer.h"
 #include "util.h"
 
 extern int g_verbosity;
+extern unsigned int g_fcch_decimation;
+extern int g_fcch_engine;
+extern int g_fcch_gate;
+extern int g_energy_gate;
+extern int g_sch;
+extern double g_pfa;
+extern int g_coarse;
+extern int g_auto_gain;
+extern int g_soa;
 
 static const float ERROR_DETECT_OFFSET_MAX = 40e3;
 
+#define GSM_RATE (1625000.0 / 6.0)
+
 #ifdef _WIN32
 #define BUFSIZ 1024
 #endif
 
-static double vectornorm2(const complex *v, const unsigned int len) {
+/*
+ * One per device.  The channels of each pass are dealt out in turn, so
+ * worker k takes chans[k], chans[k + count], ...  Results go into arrays
+ * indexed by channel, which no two workers share a slot of.
+ */
+struct c0_worker {
+	usrp_source	*u;
+	fcch_detector	*detector;
+	sch_detector	*sch;
 
-	unsigned int i;
-	double e = 0.0;
+	// with a batch, one detector and capture for each of its lanes
+	fcch_batch	*batch;
+	fcch_detector	*lane_d[fcch_batch::LANES];
+	complex		*lane_s[fcch_batch::LANES];
+	unsigned int	lane_len;
 
-	for(i = 0; i < len; i++)
-		e += norm(v[i]);
+	int		bi,
+			index,
+			count,
+			*chans,
+			chan_count,
+			coarse_chan,
+			r;
+	unsigned int	frames_len;
+	double		*power;
+	int		*found;	// device index + 1, 0 if not found
+	float		*offset,
+			*pm,
+			*pm_min,
+			*limit;
+	pthread_t	thread;
+};
 
-	return e;
-}
 
+static int capture(c0_worker *w, double freq, unsigned int len) {
 
-int c0_detect(usrp_source *u, int bi) {
+	unsigned int overruns;
 
-#define GSM_RATE (1625000.0 / 6.0)
-#define  NOTFOUND_MAX 10
-
-	int i, chan_count;
-	unsigned int overruns, b_len, frames_len, found_count, notfound_count, r;
-	float offset, spower[BUFSIZ], effective_offset, min_offset, max_offset;
-	double freq, sps, n, power[BUFSIZ], sum = 0, a;
-	complex *b;
-	circular_buffer *ub;
-	fcch_detector *detector = new fcch_detector(u->sample_rate());
-
-	if(bi == BI_NOT_DEFINED) {
-		fprintf(stderr, "error: c0_detect: band not defined\n");
+	if(!w->u->tune(freq)) {
+		fprintf(stderr, "error: usrp_source::tune\n");
 		return -1;
 	}
 
-	sps = u->sample_rate() / GSM_RATE;
-	frames_len = (unsigned int)ceil((12 * 8 * 156.25 + 156.25) * sps);
-	ub = u->get_buffer();
-
-	// first, we calculate the power in each channel
-	if(g_verbosity > 2) {
-		fprintf(stderr, "calculate power in each channel:\n");
-	}
-	u->start();
-	u->flush();
-	for(i = first_chan(bi); i >= 0; i = next_chan(i, bi)) {
-		freq = arfcn_to_freq(i, &bi);
-		if(!u->tune(freq)) {
-			fprintf(stderr, "error: usrp_source::tune\n");
+	do {
+		w->u->flush();
+		if(w->u->fill(len, &overruns)) {
+			fprintf(stderr, "error: usrp_source::fill\n");
 			return -1;
 		}
+	} while(overruns);
 
-		do {
-			u->flush();
-			if(u->fill(frames_len, &overruns)) {
-				fprintf(stderr, "error: usrp_source::fill\n");
-				return -1;
-			}
-		} while(overruns);
+	return 0;
+}
 
-		b = (complex *)ub->peek(&b_len);
-		n = sqrt(vectornorm2(b, frames_len));
-		power[i] = n;
+
+// calculate the power in each channel
+static void *power_thread(void *arg) {
+
+	c0_worker *w = (c0_worker *)arg;
+	int i, k;
+	unsigned int b_len;
+	double freq, n;
+	complex *b;
+	soa_buffer *a;
+	power_sum p;
+
+	w->r = 0;
+	for(k = w->index; k < w->chan_count; k += w->count) {
+		i = w->chans[k];
+		freq = arfcn_to_freq(i, &w->bi);
+		if(capture(w, freq, w->frames_len)) {
+			w->r = -1;
+			break;
+		}
+
+		if(w->u->fixed()) {
+			b = (complex *)w->u->get_buffer()->peek(&b_len);
+			n = sqrt((double)norm2_q15((complex16 *)b, w->frames_len));
+		} else if(g_soa) {
+			a = w->u->get_soa();
+			n = sqrt(norm2_soa(a->i(), a->q(), w->frames_len));
+		} else {
+			b = (complex *)w->u->get_buffer()->peek(&b_len);
+			p.reset();
+			p.add(b, w->frames_len);
+			n = sqrt(p.value());
+		}
+		w->power[i] = n;
 		if(g_verbosity > 2) {
 			fprintf(stderr, "\tchan %d (%.1fMHz):\tpower: %lf\n",
 			   i, freq / 1e6, n);
 		}
 	}
 
-	/*
-	 * We want to use the average to determine which channels have
-	 * power, and hence a possibility of being channel 0 on a BTS.
-	 * However, some channels in the band can be extremely noisy.  (E.g.,
-	 * CDMA traffic in GSM-850.)  Hence we won't consider the noisiest
-	 * channels when we construct the average.
-	 */
-	chan_count = 0;
-	for(i = first_chan(bi); i >= 0; i = next_chan(i, bi)) {
-		spower[chan_count++] = power[i];
-	}
-	sort(spower, chan_count);
+	return 0;
+}
+
+
+/*
+ * We want to use the average to determine which channels have power, and
+ * hence a possibility of being channel 0 on a BTS.  However, some channels
+ * in the band can be extremely noisy.  (E.g., CDMA traffic in GSM-850.)
+ * Hence we won't consider the noisiest channels when we construct the
+ * average.  This is over every step'th channel from first on.
+ */
+static double noise_floor(double *power, int *chans, int chan_count,
+   int first, int step) {
+
+	float spower[BUFSIZ];
+	int k, n;
+
+	n = 0;
+	for(k = first; k < chan_count; k += step)
+		spower[n++] = power[chans[k]];
+	if(!n)
+		return 0.0;
+	sort(spower, n);
 
 	// average the lowest %60
-	a = avg(spower, chan_count - 4 * chan_count / 10, 0);
+	return avg(spower, n - 4 * n / 10, 0);
+}
 
-	if(g_verbosity > 0) {
-		fprintf(stderr, "channel detect threshold: %lf\n", a);
+
+/*
+ * Without a rough estimate from the user, the strongest channel is our best
+ * bet for a tower to get one from.  Each device needs its own.
+ */
+static void coarse(c0_worker *w) {
+
+	if(g_coarse) {
+		if(g_verbosity > 0) {
+			fprintf(stderr, "coarse search on chan %d\n", w->coarse_chan);
+		}
+		coarse_detect(w->u, arfcn_to_freq(w->coarse_chan, &w->bi));
 	}
+}
+
+
+#define  NOTFOUND_MAX 10
+
+// look for fcch bursts
+static void *fcch_thread(void *arg) {
+
+	c0_worker *w = (c0_worker *)arg;
+	int i, k;
+	unsigned int b_len, notfound_count, r, overruns;
+	float offset;
+	double freq;
+	complex *b;
+	circular_buffer *ub = w->u->get_buffer();
+	fcch_detector *detector = w->detector;
+
+	w->r = 0;
+	coarse(w);
 
-	// then we look for fcch bursts
-	printf("%s:\n", bi_to_str(bi));
-	found_count = 0;
 	notfound_count = 0;
-	sum = 0;
-	i = first_chan(bi);
-	do {
-		if(power[i] <= a) {
-			i = next_chan(i, bi);
-			continue;
-		}
+	k = w->index;
+	while(k < w->chan_count) {
+		i = w->chans[k];
 		if (isatty(1)) {
 			printf("...chan %i\r", i);
 			fflush(stdout);
 		}
 
-		freq = arfcn_to_freq(i, &bi);
-		if(!u->tune(freq)) {
+		// the detector is ours for the whole scan, just forget the last channel
+		if(!notfound_count)
+			detector->reset();
+
+		freq = arfcn_to_freq(i, &w->bi);
+		if(!w->u->tune(freq)) {
 			fprintf(stderr, "error: usrp_source::tune\n");
-			return -1;
+			w->r = -1;
+			return 0;
 		}
 
-		do {
-			u->flush();
-			if(u->fill(frames_len, &overruns)) {
-				fprintf(stderr, "error: usrp_source::fill\n");
-				return -1;
+		// towers differ a lot in strength, so set the gain per channel
+		if(g_auto_gain && !notfound_count) {
+			if(w->u->auto_gain() < 0) {
+				fprintf(stderr, "error: usrp_source::auto_gain\n");
+				w->r = -1;
+				return 0;
 			}
-		} while(overruns);
+		}
+
+		if(capture(w, freq, w->frames_len)) {
+			w->r = -1;
+			return 0;
+		}
 
 		b = (complex *)ub->peek(&b_len);
-		r = detector->scan(b, b_len, &offset, 0);
-		effective_offset = offset - GSM_RATE / 4;
-		if(r && (fabsf(effective_offset) < ERROR_DETECT_OFFSET_MAX)) {
-			// found
-			if (found_count) {
-				min_offset = fmin(min_offset, effective_offset);
-				max_offset = fmax(max_offset, effective_offset);
-			} else {
-				min_offset = max_offset = effective_offset;
+		if(w->u->fixed())
+			r = detector->scan_q15((complex16 *)b, b_len, &offset, 0);
+		else if(g_soa)
+			r = detector->scan_soa(b, w->u->get_soa(), b_len,
+			   &offset, 0);
+		else
+			r = detector->scan(b, b_len, &offset, 0);
+
+		// the SCH one frame later must confirm it
+		if(r && w->sch) {
+			overruns = 0;
+			if(w->sch->needed(detector->found_at()) > b_len) {
+				if(w->u->fill(w->sch->needed(detector->found_at()),
+				   &overruns)) {
+					fprintf(stderr, "error: usrp_source::fill\n");
+					w->r = -1;
+					return 0;
+				}
+				b = (complex *)ub->peek(&b_len);
 			}
-			found_count++;
-			printf("    chan: %4d (%.1fMHz ", i, freq / 1e6);
-			display_freq(effective_offset);
-			printf(")    power: %10.2f\n", power[i]);
+
+			// the SCH isn't where the burst said, try again
+			if(overruns)
+				r = 0;
+			else
+				r = w->sch->detect(b, b_len, detector->found_at(),
+				   &offset);
+		}
+		offset = offset - GSM_RATE / 4;
+		if(r && (fabsf(offset) < ERROR_DETECT_OFFSET_MAX)) {
+			// found
+			w->found[i] = w->index + 1;
+			w->offset[i] = offset;
+			detector->thresholds(&w->pm[i], &w->pm_min[i], &w->limit[i]);
 			notfound_count = 0;
-			i = next_chan(i, bi);
+			k += w->count;
 		} else {
 			// not found
 			notfound_count += 1;
 			if(notfound_count >= NOTFOUND_MAX) {
 				notfound_count = 0;
-				i = next_chan(i, bi);
+				k += w->count;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * fcch_thread() with the adaptive filters of up to fcch_batch::LANES
+ * channels run together.  Each lane keeps its channel until it is found or
+ * has been tried NOTFOUND_MAX times, then takes the next one.
+ */
+static void *fcch_lanes_thread(void *arg) {
+
+	const unsigned int LANES = fcch_batch::LANES;
+
+	c0_worker *w = (c0_worker *)arg;
+	int i, next, lane_k[LANES], map[LANES];
+	unsigned int j, n, m, b_len, s_len, capture_len, lane_n[LANES],
+	   notfound_count[LANES], r[LANES];
+	float offset[LANES];
+	double freq;
+	complex *b;
+	const complex *s[LANES];
+	fcch_detector *d[LANES];
+	circular_buffer *ub = w->u->get_buffer();
+
+	/*
+	 * The lanes' channels are retuned before their SCH could be filled in
+	 * after a burst near the end, so capture all the SCH may need up front
+	 * and only scan the usual length for the FCCH.
+	 */
+	capture_len = w->frames_len;
+	if(w->sch)
+		capture_len = w->sch->needed(w->frames_len);
+
+	w->r = 0;
+	coarse(w);
+
+	next = w->index;
+	for(j = 0; j < LANES; j++)
+		lane_k[j] = -1;
+	for(;;) {
+
+		// idle lanes take the next channels, then capture every lane
+		n = 0;
+		s_len = w->sch? w->frames_len : w->lane_len;
+		for(j = 0; j < LANES; j++) {
+			if((lane_k[j] < 0) && (next < w->chan_count)) {
+				lane_k[j] = next;
+				notfound_count[j] = 0;
+				w->lane_d[j]->reset();
+				next += w->count;
+			}
+			if(lane_k[j] < 0)
+				continue;
+
+			i = w->chans[lane_k[j]];
+			if (isatty(1)) {
+				printf("...chan %i\r", i);
+				fflush(stdout);
+			}
+
+			freq = arfcn_to_freq(i, &w->bi);
+			if(!w->u->tune(freq)) {
+				fprintf(stderr, "error: usrp_source::tune\n");
+				w->r = -1;
+				return 0;
+			}
+			if(g_auto_gain && !notfound_count[j]) {
+				if(w->u->auto_gain() < 0) {
+					fprintf(stderr, "error: usrp_source::auto_gain\n");
+					w->r = -1;
+					return 0;
+				}
+			}
+			if(capture(w, freq, capture_len)) {
+				w->r = -1;
+				return 0;
+			}
+
+			b = (complex *)ub->peek(&b_len);
+			lane_n[j] = (b_len < w->lane_len)? b_len : w->lane_len;
+			if(lane_n[j] < s_len)
+				s_len = lane_n[j];
+			memcpy(w->lane_s[j], b, sizeof(complex) * lane_n[j]);
+			map[n] = j;
+			d[n] = w->lane_d[j];
+			s[n] = w->lane_s[j];
+			n += 1;
+		}
+		if(!n)
+			break;
+
+		if(w->batch->scan(d, s, s_len, n, r, offset)) {
+			fprintf(stderr, "error: fcch_batch::scan\n");
+			w->r = -1;
+			return 0;
+		}
+
+		for(m = 0; m < n; m++) {
+			j = map[m];
+			i = w->chans[lane_k[j]];
+
+			// the SCH one frame later must confirm it
+			if(r[m] && w->sch) {
+				if(w->sch->needed(d[m]->found_at()) > lane_n[j])
+					r[m] = 0;
+				else
+					r[m] = w->sch->detect(s[m], lane_n[j],
+					   d[m]->found_at(), &offset[m]);
+			}
+			offset[m] = offset[m] - GSM_RATE / 4;
+			if(r[m] && (fabsf(offset[m]) < ERROR_DETECT_OFFSET_MAX)) {
+				// found
+				w->found[i] = w->index + 1;
+				w->offset[i] = offset[m];
+				d[m]->thresholds(&w->pm[i], &w->pm_min[i],
+				   &w->limit[i]);
+				lane_k[j] = -1;
+			} else if(++notfound_count[j] >= NOTFOUND_MAX) {
+				lane_k[j] = -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+static fcch_detector *new_detector(usrp_source *u) {
+
+	fcch_detector *l;
+
+	l = new fcch_detector(u->sample_rate(), u->get_buffer()->buf_len());
+	if(l->set_decimation(g_fcch_decimation)) {
+		fprintf(stderr, "error: fcch_detector::set_decimation\n");
+		return 0;
+	}
+	if(l->set_engine(g_fcch_engine)) {
+		fprintf(stderr, "error: fcch_detector::set_engine\n");
+		return 0;
+	}
+	l->set_gate(g_fcch_gate);
+	if(l->set_zoom(ERROR_DETECT_OFFSET_MAX)) {
+		fprintf(stderr, "error: fcch_detector::set_zoom\n");
+		return 0;
+	}
+	if(l->set_pfa(g_pfa)) {
+		fprintf(stderr, "error: fcch_detector::set_pfa\n");
+		return 0;
+	}
+
+	return l;
+}
+
+
+/*
+ * Runs f on every worker, each on its own thread when there is more than
+ * one device.  Returns -1 if any of them failed.
+ */
+static int run_workers(c0_worker *w, int count, void *(*f)(void *)) {
+
+	int k, r = 0;
+
+	if(count == 1) {
+		f(&w[0]);
+		return w[0].r;
+	}
+	for(k = 0; k < count; k++) {
+		if(pthread_create(&w[k].thread, 0, f, &w[k])) {
+			fprintf(stderr, "error: pthread_create\n");
+			w[k].r = -1;
+			w[k].count = 0;
+		}
+	}
+	for(k = 0; k < count; k++) {
+		if(w[k].count)
+			pthread_join(w[k].thread, 0);
+		if(w[k].r)
+			r = -1;
+	}
+
+	return r;
+}
+
+
+int c0_detect(usrp_source **u, int u_count, int bi) {
+
+	int i, k, d, chan_count, cand_count, strongest, chans[BUFSIZ],
+	   cands[BUFSIZ], found[BUFSIZ];
+	unsigned int j, frames_len, found_count, dev_found[BUFSIZ];
+	float offsets[BUFSIZ], pm[BUFSIZ], pm_min[BUFSIZ],
+	   limit[BUFSIZ], min_offset[BUFSIZ], max_offset[BUFSIZ], spread;
+	double freq, sps, power[BUFSIZ], dev_floor[BUFSIZ], a;
+	c0_worker *w;
+
+	if(bi == BI_NOT_DEFINED) {
+		fprintf(stderr, "error: c0_detect: band not defined\n");
+		return -1;
+	}
+
+	sps = u[0]->sample_rate() / GSM_RATE;
+	frames_len = (unsigned int)ceil((12 * 8 * 156.25 + 156.25) * sps);
+
+	chan_count = 0;
+	for(i = first_chan(bi); i >= 0; i = next_chan(i, bi)) {
+		chans[chan_count++] = i;
+		found[i] = 0;
+	}
+
+	/*
+	 * Each device gets its own detectors.  They are set up here, as fftw
+	 * doesn't like making plans on several threads at once.
+	 */
+	w = new c0_worker[u_count];
+	for(k = 0; k < u_count; k++) {
+		w[k].u = u[k];
+		w[k].bi = bi;
+		w[k].index = k;
+		w[k].count = u_count;
+		w[k].frames_len = frames_len;
+		w[k].power = power;
+		w[k].found = found;
+		w[k].offset = offsets;
+		w[k].pm = pm;
+		w[k].pm_min = pm_min;
+		w[k].limit = limit;
+		w[k].r = 0;
+
+		// leave room for the SCH after a burst at the end of the capture
+		w[k].sch = 0;
+		if(g_sch) {
+			w[k].sch = new sch_detector(u[k]->sample_rate());
+			if(w[k].sch->set_pfa(g_pfa)) {
+				fprintf(stderr, "error: sch_detector::set_pfa\n");
+				return -1;
+			}
+			u[k]->set_capture_len(w[k].sch->needed(frames_len));
+		} else
+			u[k]->set_capture_len(frames_len);
+		if(!(w[k].detector = new_detector(u[k])))
+			return -1;
+
+		/*
+		 * Without the gates the adaptive filters of several channels
+		 * can run side by side.  The split layout runs them one at a
+		 * time.
+		 */
+		w[k].batch = 0;
+		if((!g_energy_gate) && (!u[k]->fixed()) && (!g_soa) &&
+		   fcch_batch::supports(w[k].detector)) {
+			w[k].lane_len = u[k]->get_buffer()->buf_len();
+			w[k].batch = new fcch_batch(w[k].lane_len);
+			for(j = 0; j < fcch_batch::LANES; j++) {
+				w[k].lane_d[j] = j? new_detector(u[k]) : w[k].detector;
+				if(!w[k].lane_d[j])
+					return -1;
+				w[k].lane_s[j] = new complex[w[k].lane_len];
+			}
+		}
+		u[k]->start();
+		u[k]->flush();
+	}
+
+	// first, we calculate the power in each channel
+	if(g_verbosity > 2) {
+		fprintf(stderr, "calculate power in each channel:\n");
+	}
+	for(k = 0; k < u_count; k++) {
+		w[k].chans = chans;
+		w[k].chan_count = chan_count;
+	}
+	if(run_workers(w, u_count, power_thread))
+		return -1;
+
+	/*
+	 * Each device measured its own share of the channels with its own
+	 * gain, so bring every device's noise floor to the common one before
+	 * the channels are compared against a single threshold.
+	 */
+	a = noise_floor(power, chans, chan_count, 0, 1);
+	if(u_count > 1) {
+		for(k = 0; k < u_count; k++) {
+			dev_floor[k] = noise_floor(power, chans, chan_count, k,
+			   u_count);
+			if(dev_floor[k] <= 0.0)
+				dev_floor[k] = a;
+			if(g_verbosity > 0) {
+				fprintf(stderr, "device %d noise floor: %lf\n",
+				   k, dev_floor[k]);
 			}
 		}
-	} while(i >= 0);
+		for(k = 0; k < chan_count; k++)
+			power[chans[k]] *= a / dev_floor[k % u_count];
+		a = noise_floor(power, chans, chan_count, 0, 1);
+	} else
+		dev_floor[0] = a;
+
+	strongest = chans[0];
+	for(k = 0; k < chan_count; k++) {
+		if(power[chans[k]] > power[strongest])
+			strongest = chans[k];
+	}
+
+	if(g_verbosity > 0) {
+		fprintf(stderr, "channel detect threshold: %lf\n", a);
+	}
+
+	cand_count = 0;
+	for(k = 0; k < chan_count; k++) {
+		if(power[chans[k]] > a)
+			cands[cand_count++] = chans[k];
+	}
+
+	// then we look for fcch bursts
+	printf("%s:\n", bi_to_str(bi));
+	for(k = 0; k < u_count; k++) {
+		// the quiet channels also tell the detector where the noise floor is
+		if(g_energy_gate) {
+			w[k].detector->set_noise_floor(dev_floor[k] *
+			   dev_floor[k] / frames_len);
+		}
+		w[k].chans = cands;
+		w[k].chan_count = cand_count;
+		w[k].coarse_chan = strongest;
+	}
+	if(run_workers(w, u_count, w[0].batch? fcch_lanes_thread : fcch_thread))
+		return -1;
+
+	/*
+	 * Report in channel order.  Each device has its own clock error, so
+	 * only offsets measured by the same one should agree.
+	 */
+	found_count = 0;
+	for(k = 0; k < u_count; k++)
+		dev_found[k] = 0;
+	for(k = 0; k < cand_count; k++) {
+		i = cands[k];
+		if(!found[i])
+			continue;
+		d = found[i] - 1;
+		if (dev_found[d]) {
+			min_offset[d] = fmin(min_offset[d], offsets[i]);
+			max_offset[d] = fmax(max_offset[d], offsets[i]);
+		} else {
+			min_offset[d] = max_offset[d] = offsets[i];
+		}
+		dev_found[d]++;
+		found_count++;
+		freq = arfcn_to_freq(i, &bi);
+		printf("    chan: %4d (%.1fMHz ", i, freq / 1e6);
+		display_freq(offsets[i]);
+		printf(")    power: %10.2f", power[i]);
+		if(u_count > 1)
+			printf("    device: %d", d);
+		printf("\n");
+		if(g_verbosity > 1) {
+			fprintf(stderr, "\tpm %.1f > %.1f\tlimit %.2f\n",
+			   pm[i], pm_min[i], limit[i]);
+		}
+	}
+	spread = 0.0;
+	for(k = 0; k < u_count; k++) {
+		if(dev_found[k] > 1)
+			spread = fmax(spread, max_offset[k] - min_offset[k]);
+	}
 
 	if (found_count == 1) {
 		printf("\n");
@@ -195,12 +673,27 @@ int c0_detect(usrp_source *u, int bi) {
 	/*
 	 * If the difference in offsets found is strangely large
 	 */
-	if (found_count > 1 && max_offset - min_offset > 1000) {
+	if (spread > 1000) {
 		printf("\n");
 		printf("Difference of offsets between channels is >1kHz. This likely "
 			"means that the correct PPM is too far away and you need to provide "
 			"a rough estimate using the '-e' option. Try tuning against "
 			"a local FM radio or other known frequency first.\n");
 	}
+
+	for(k = 0; k < u_count; k++) {
+		w[k].detector->print_compare();
+		if(w[k].batch) {
+			for(j = 1; j < fcch_batch::LANES; j++)
+				delete w[k].lane_d[j];
+			for(j = 0; j < fcch_batch::LANES; j++)
+				delete[] w[k].lane_s[j];
+			delete w[k].batch;
+		}
+		delete w[k].detector;
+		delete w[k].sch;
+	}
+	delete[] w;
+
 	return 0;
 }
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "usrp_source.h"
+#include "circular_buffer.h"
+#include "fcch_detector.h"
+#include "util.h"
+
+#ifdef _WIN32
+inline double round(double x) { return floor(x + 0.5); }
+#endif
+
+extern int g_verbosity;
+extern int g_fcch_engine;
+extern int g_fcch_gate;
+extern double g_pfa;
+extern int g_soa;
+
+// search this far either side of the nominal frequency
+static const double		COARSE_PPM_MAX	= 100.0;
+
+// fraction of the sample rate each tuning step covers
+static const double		COARSE_SPAN	= 0.75;
+
+// detections per step and the scans allowed to get them
+static const unsigned int	COARSE_COUNT	= 5;
+static const unsigned int	COARSE_TRIES	= 12;
+
+// detections within this many Hz of the median agree with it
+static const float		COARSE_AGREE	= 500.0;
+
+
+/*
+ * Find the FCCH of the tower at freq when our oscillator may be off by as
+ * much as COARSE_PPM_MAX.  That can put the tone well outside what a single
+ * capture sees, so we step the tuner across the range, nearest steps first,
+ * and stop at the first step where most detections agree.  The correction
+ * found is applied to the source; offset_detect() then measures what is
+ * left of the error.
+ *
+ * Returns 0 when a correction was applied and -1 when nothing was found.
+ */
+int coarse_detect(usrp_source *u, double freq) {
+
+#define GSM_RATE (1625000.0 / 6.0)
+
+	int k;
+	unsigned int overruns, b_len, frames_len, count, agree, tries, i, r;
+	float offset, offsets[COARSE_COUNT], median, fs;
+	double sps, range, step, delta, tuner_error, ppm;
+	complex *b;
+	circular_buffer *ub;
+	fcch_detector *detector;
+
+	fs = u->sample_rate();
+	sps = fs / GSM_RATE;
+	frames_len = (unsigned int)ceil((12 * 8 * 156.25 + 156.25) * sps);
+
+	// a scan may call us with its own capture already set up
+	ub = u->get_buffer();
+	if(ub->buf_len() < frames_len) {
+		u->set_capture_len(frames_len);
+		ub = u->get_buffer();
+	}
+
+	/*
+	 * The tone can land anywhere in the band, so the mixing front end,
+	 * which assumes it is near GSM_RATE / 4, stays off.
+	 */
+	detector = new fcch_detector(fs, ub->buf_len());
+	if(detector->set_engine(g_fcch_engine)) {
+		fprintf(stderr, "error: fcch_detector::set_engine\n");
+		delete detector;
+		return -1;
+	}
+	detector->set_gate(g_fcch_gate);
+	if(detector->set_pfa(g_pfa)) {
+		fprintf(stderr, "error: fcch_detector::set_pfa\n");
+		delete detector;
+		return -1;
+	}
+
+	range = COARSE_PPM_MAX * 1e-6 * freq;
+	step = COARSE_SPAN * fs;
+
+	/*
+	 * A step tuned delta away sees the tone within step / 2 of the
+	 * centre, i.e., towers from delta - GSM_RATE / 4 - step / 2 to
+	 * delta - GSM_RATE / 4 + step / 2.
+	 */
+	u->start();
+	for(k = 0; fabs((double)k) * step <= range + step; k = (k > 0)? -k : 1 - k) {
+		delta = k * step;
+		if(fabs(delta - GSM_RATE / 4) > range + step / 2)
+			continue;
+		if(!u->tune(freq + delta)) {
+			fprintf(stderr, "error: usrp_source::tune\n");
+			delete detector;
+			return -1;
+		}
+		tuner_error = u->m_center_freq - (freq + delta);
+
+		count = 0;
+		for(tries = 0; (tries < COARSE_TRIES) && (count < COARSE_COUNT); tries++) {
+			do {
+				u->flush();
+				if(u->fill(frames_len, &overruns)) {
+					fprintf(stderr, "error: usrp_source::fill\n");
+					delete detector;
+					return -1;
+				}
+			} while(overruns);
+
+			b = (complex *)ub->peek(&b_len);
+			if(u->fixed())
+				r = detector->scan_q15((complex16 *)b, b_len,
+				   &offset, 0);
+			else if(g_soa)
+				r = detector->scan_soa(b, u->get_soa(), b_len,
+				   &offset, 0);
+			else
+				r = detector->scan(b, b_len, &offset, 0);
+			if(!r)
+				continue;
+
+			// the tone is GSM_RATE / 4 above the tower
+			if(offset > fs / 2)
+				offset -= fs;
+			if(fabs(offset) > step / 2)
+				continue;
+			offset = offset - GSM_RATE / 4 - tuner_error;
+			offsets[count++] = offset;
+		}
+
+		if(g_verbosity > 0) {
+			fprintf(stderr, "\tcoarse step %+.0fkHz: %u of %u scans "
+			   "found a tone\n", delta / 1e3, count, tries);
+		}
+		if(count < (COARSE_COUNT + 1) / 2)
+			continue;
+
+		sort(offsets, count);
+		median = offsets[count / 2];
+		agree = 0;
+		for(i = 0; i < count; i++) {
+			if(fabs(offsets[i] - median) < COARSE_AGREE)
+				agree++;
+		}
+		if(agree < (COARSE_COUNT + 1) / 2)
+			continue;
+
+		/*
+		 * Same arithmetic as offset_detect(): the tower appears
+		 * median + delta away from where we tuned.
+		 */
+		ppm = u->m_freq_corr - ((median + delta) / freq) * 1000000;
+		fprintf(stderr, "Coarse frequency error: %.1f ppm\n", ppm);
+		delete detector;
+
+		if((int)round(ppm) != u->m_freq_corr) {
+			if(u->set_freq_correction((int)round(ppm)) < 0) {
+				fprintf(stderr, "error: usrp_source::set_freq_correction\n");
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	fprintf(stderr, "warning: coarse search found no frequency bursts "
+	   "within %.0f ppm\n", COARSE_PPM_MAX);
+	delete detector;
+	return -1;
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <stdexcept>
+#include "fcch_batch.h"
+#include "fcch_detector.h"
+
+
+/*
+ * max_len is the most samples any one channel will hand to scan().
+ */
+fcch_batch::fcch_batch(const unsigned int max_len) {
+
+	m_max_len = max_len;
+	m_w_len = 0;
+	m_D = 0;
+	m_xr = new float[max_len * LANES];
+	m_xi = new float[max_len * LANES];
+	m_err = new float[max_len * LANES];
+}
+
+
+fcch_batch::~fcch_batch() {
+
+	delete[] m_xr;
+	delete[] m_xi;
+	delete[] m_err;
+}
+
+
+/*
+ * Only the plain adaptive filter over a whole capture runs in lanes.  The
+ * gates pick their own regions of each capture and the stream modes carry
+ * state between scans, which would take the lanes out of step.
+ */
+bool fcch_batch::supports(fcch_detector *d) {
+
+	return (d->m_engine == fcch_detector::ENGINE_LMS) && (!d->m_gate) &&
+	   (!d->m_noise_floor) && (!d->m_continuous) &&
+	   (d->m_w_len <= W_MAX);
+}
+
+
+/*
+ * Copy each detector's taps, step size and error average into its lane.
+ * Spare lanes repeat the first so they never divide by a zero power.
+ */
+void fcch_batch::load(fcch_detector **d, const unsigned int count) {
+
+	unsigned int i, k, j;
+
+	for(k = 0; k < LANES; k++) {
+		j = (k < count)? k : 0;
+		for(i = 0; i < m_w_len; i++) {
+			m_wr[i * LANES + k] = d[j]->m_w[i].real();
+			m_wi[i * LANES + k] = d[j]->m_w[i].imag();
+		}
+		m_G[k] = d[j]->m_G;
+		m_p[k] = d[j]->m_p;
+		m_e[k] = d[j]->m_e;
+	}
+}
+
+
+// hand the filter state back so the detectors carry on as if they had run
+void fcch_batch::store(fcch_detector **d, const unsigned int count) {
+
+	unsigned int i, k;
+
+	for(k = 0; k < count; k++) {
+		for(i = 0; i < m_w_len; i++)
+			d[k]->m_w[i] = complex(m_wr[i * LANES + k],
+			   m_wi[i * LANES + k]);
+		d[k]->m_G = m_G[k];
+		d[k]->m_e = m_e[k];
+	}
+}
+
+
+// power_sum::add() on a lane
+static inline void power_add(double &sum, double &c, const double p) {
+
+	double y = p - c, t = sum + y;
+
+	c = (t - sum) - y;
+	sum = t;
+}
+
+
+/*
+ * fcch_detector::next_norm_error() for every lane and every sample.  Error t
+ * is that of the filter over samples t to t + w_len - 1 predicting sample
+ * t + w_len - 1 + D.
+ *
+ * 	y = sum(conj(w[i]) * x[n - i])
+ * 	e = x[n + D] - y
+ * 	w[i] += G * conj(e) * x[n - i]
+ *
+ * with the complex products written out so each loop is over lanes only.
+ */
+void fcch_batch::filter(const unsigned int x_len) {
+
+	const unsigned int n = m_w_len - 1;
+	const unsigned int delay = n + m_D;
+
+	unsigned int t, i, k;
+	float wr[W_MAX * LANES], wi[W_MAX * LANES], G[LANES], p[LANES],
+	   e[LANES], E[LANES], yr[LANES], yi[LANES], er[LANES], ei[LANES];
+	double P[LANES], C[LANES];
+	float *w_r, *w_i;
+	const float *xr, *xi, *x_r, *x_i;
+
+	/*
+	 * Work on local copies, which the compiler knows the samples can't
+	 * alias.  Each loop over lanes goes through pointers to the start of
+	 * a row so it sees LANES consecutive floats.
+	 */
+	memcpy(wr, m_wr, sizeof(float) * m_w_len * LANES);
+	memcpy(wi, m_wi, sizeof(float) * m_w_len * LANES);
+	memcpy(G, m_G, sizeof(G));
+	memcpy(p, m_p, sizeof(p));
+	memcpy(e, m_e, sizeof(e));
+
+	for(t = 0; t + delay < x_len; t++) {
+		xr = m_xr + (size_t)t * LANES;
+		xi = m_xi + (size_t)t * LANES;
+
+		/*
+		 * Update G.  The window power slides along with t, the
+		 * sample leaving it taken out and the one entering it added
+		 * in, as power_sum does for next_norm_error().
+		 */
+		if(!t) {
+			for(k = 0; k < LANES; k++)
+				P[k] = C[k] = 0.0;
+			for(i = 0; i < m_w_len; i++) {
+				x_r = xr + i * LANES;
+				x_i = xi + i * LANES;
+				for(k = 0; k < LANES; k++)
+					power_add(P[k], C[k], x_r[k] * x_r[k] + x_i[k] * x_i[k]);
+			}
+		} else {
+			x_r = xr - LANES;
+			x_i = xi - LANES;
+			for(k = 0; k < LANES; k++)
+				power_add(P[k], C[k], -(x_r[k] * x_r[k] + x_i[k] * x_i[k]));
+			x_r = xr + n * LANES;
+			x_i = xi + n * LANES;
+			for(k = 0; k < LANES; k++)
+				power_add(P[k], C[k], x_r[k] * x_r[k] + x_i[k] * x_i[k]);
+		}
+		for(k = 0; k < LANES; k++) {
+			E[k] = P[k] - C[k];
+			G[k] = (G[k] >= 2.0f / E[k])? 1.0f / E[k] : G[k];
+		}
+
+		// calculate filtered value
+		for(k = 0; k < LANES; k++) {
+			yr[k] = 0.0;
+			yi[k] = 0.0;
+		}
+		for(i = 0; i < m_w_len; i++) {
+			x_r = xr + (n - i) * LANES;
+			x_i = xi + (n - i) * LANES;
+			w_r = wr + i * LANES;
+			w_i = wi + i * LANES;
+			for(k = 0; k < LANES; k++) {
+				yr[k] += w_r[k] * x_r[k] + w_i[k] * x_i[k];
+				yi[k] += w_r[k] * x_i[k] - w_i[k] * x_r[k];
+			}
+		}
+
+		// calculate error from desired signal, scaled by the step
+		x_r = xr + (n + m_D) * LANES;
+		x_i = xi + (n + m_D) * LANES;
+		for(k = 0; k < LANES; k++) {
+			er[k] = x_r[k] - yr[k];
+			ei[k] = x_i[k] - yi[k];
+			e[k] = (1.0f - p[k]) * e[k] +
+			   p[k] * (er[k] * er[k] + ei[k] * ei[k]);
+			er[k] *= G[k];
+			ei[k] *= G[k];
+		}
+
+		// update filters with opposite gradient
+		for(i = 0; i < m_w_len; i++) {
+			x_r = xr + (n - i) * LANES;
+			x_i = xi + (n - i) * LANES;
+			w_r = wr + i * LANES;
+			w_i = wi + i * LANES;
+			for(k = 0; k < LANES; k++) {
+				w_r[k] += er[k] * x_r[k] + ei[k] * x_i[k];
+				w_i[k] += er[k] * x_i[k] - ei[k] * x_r[k];
+			}
+		}
+
+		// store the error ratio
+		for(k = 0; k < LANES; k++)
+			m_err[k * m_max_len + t] = e[k] / (E[k] / m_w_len);
+	}
+
+	memcpy(m_wr, wr, sizeof(float) * m_w_len * LANES);
+	memcpy(m_wi, wi, sizeof(float) * m_w_len * LANES);
+	memcpy(m_G, G, sizeof(G));
+	memcpy(m_e, e, sizeof(e));
+}
+
+
+/*
+ * scan:
+ * 	fcch_detector::scan() of s[k] with d[k] for each of count channels,
+ * 	each capture s_len samples long.  r[k] and offset[k] are what that
+ * 	would have returned.  The detectors must have the same filter and
+ * 	decimation and all pass supports().
+ *
+ * 	Returns -1 if they can't run together.
+ */
+int fcch_batch::scan(fcch_detector **d, const complex **s, const unsigned int s_len, const unsigned int count, unsigned int *r, float *offset) {
+
+	unsigned int i, k, j, x_len = 0, l_len;
+	const complex *x;
+
+	if((!count) || (count > LANES))
+		return -1;
+	for(k = 0; k < count; k++) {
+		if((!supports(d[k])) || (d[k]->m_w_len != d[0]->m_w_len) ||
+		   (d[k]->m_D != d[0]->m_D) ||
+		   (d[k]->m_decimation != d[0]->m_decimation))
+			return -1;
+	}
+	m_w_len = d[0]->m_w_len;
+	m_D = d[0]->m_D;
+
+	// lay the front end output of each channel out lane by lane
+	for(k = 0; k < count; k++) {
+		x = d[k]->front_end(s[k], s_len, &l_len);
+		if((!k) && (l_len > m_max_len))
+			return -1;
+		x_len = l_len;
+		for(i = 0; i < x_len; i++) {
+			m_xr[i * LANES + k] = x[i].real();
+			m_xi[i * LANES + k] = x[i].imag();
+		}
+	}
+	for(k = count; k < LANES; k++) {
+		for(i = 0; i < x_len; i++) {
+			m_xr[i * LANES + k] = m_xr[i * LANES];
+			m_xi[i * LANES + k] = m_xi[i * LANES];
+		}
+	}
+
+	load(d, count);
+	filter(x_len);
+	store(d, count);
+
+	j = (x_len > m_w_len - 1 + m_D)? x_len - (m_w_len - 1 + m_D) : 0;
+	for(k = 0; k < count; k++) {
+		offset[k] = 0.0;
+		r[k] = d[k]->scan_errors(s[k], s_len, m_err + k * m_max_len, j,
+		   &offset[k]);
+	}
+
+	return 0;
+}
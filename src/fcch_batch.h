@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runs the adaptive filters of up to LANES fcch_detectors in lockstep, one
+ * channel in each lane.  Each filter has to wait for its last error before
+ * it can take the next sample, but the filters of different channels don't
+ * wait on each other, so with the samples, taps and errors of all of them
+ * kept lane by lane every step is a few loops the compiler can vectorize.
+ */
+
+#pragma once
+
+#include "usrp_complex.h"
+
+class fcch_detector;
+
+class fcch_batch {
+
+public:
+	static const unsigned int	LANES	= 8;
+
+	fcch_batch(const unsigned int max_len);
+	~fcch_batch();
+	static bool supports(fcch_detector *d);
+	int scan(fcch_detector **d, const complex **s, const unsigned int s_len, const unsigned int count, unsigned int *r, float *offset);
+
+private:
+	// longest adaptive filter we hold taps for
+	static const unsigned int	W_MAX	= 32;
+
+	void load(fcch_detector **d, const unsigned int count);
+	void store(fcch_detector **d, const unsigned int count);
+	void filter(const unsigned int x_len);
+
+	unsigned int	m_max_len,
+			m_w_len,
+			m_D;
+	float		*m_xr,		// sample t of lane k at [t * LANES + k]
+			*m_xi,
+			*m_err,		// error t of lane k at [k * m_max_len + t]
+			m_wr[W_MAX * LANES],
+			m_wi[W_MAX * LANES],
+			m_G[LANES],
+			m_p[LANES],
+			m_e[LANES];
+};
@@ -46,23 +46,85 @@
 
 #include <stdexcept>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "fcch_detector.h"
+#include "kernels.h"
 
 extern int g_debug;
 
 static const char * const fftw_plan_name = ".kal_fftw_plan";
 
+enum {
+	LOW	= 0,
+	HIGH	= 1
+};
+
+// the fftw planner and wisdom are shared by every thread
+static pthread_mutex_t fftw_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const unsigned int MIN_PM = 50; // XXX arbitrary, depends on decimation
+
+// adaptive filter taps either side of the middle one, at the input rate
+static const unsigned int FILTER_DELAY = 8;
+/*
+ * Peak/mean a short-time fft window must reach without a target false alarm
+ * rate.  By win_threshold()'s model a window of noise gets there about once
+ * in 160000 at 64 bins, so a run of them is all but certainly a tone.
+ */
+static const float MIN_WIN_PM = 20;
+
+/*
+ * Phase-difference gate: window length in symbols, minimum normalized
+ * correlation and padding around candidate regions in bursts.
+ *
+ * The gate only decides where the engine looks, so GATE_MIN weighs work
+ * against misses rather than following the false alarm rate.  Noise reaches
+ * a correlation c over the window with probability about
+ * exp(-GATE_WINDOW * c), 8e-3 at 0.15 (5e-3 measured, 2e-2 for random MSK
+ * traffic).  A tone at SNR s reaches (s / (1 + s))^2, so tones pass down
+ * to about -2dB.
+ */
+static const unsigned int	GATE_WINDOW	= 32;
+static const double		GATE_MIN	= 0.15;
+static const unsigned int	GATE_PAD	= 6;
+
+/*
+ * Burst tracking: alignments tried on each side of a predicted burst and how
+ * many predicted bursts may be missed before we go back to scanning.
+ */
+static const unsigned int	TRACK_STEPS	= 2;
+static const unsigned int	TRACK_MISS_MAX	= 3;
+
+/*
+ * Energy gate: block length in symbols, how far above the noise floor a
+ * block must be, and the error recorded for the samples of skipped blocks.
+ */
+static const unsigned int	ENERGY_BLOCK	= 64;
+static const float		ENERGY_GATE_SNR	= 2.0;	// 3dB
+static const float		SKIPPED_ERROR	= 1e30;
+
+// constant false alarm rate mode: symbols the errors are smoothed over
+static const unsigned int	CFAR_SMOOTH	= 16;
 
-fcch_detector::fcch_detector(const float sample_rate, const unsigned int D,
-   const float p, const float G) {
+
+/*
+ * scan_len is the largest number of samples the caller will hand to a single
+ * scan().  The error buffer only has to hold one error per sample of that and
+ * the sample buffers only have to hold the filter history, so size them from
+ * it rather than from a worst-case guess.
+ */
+fcch_detector::fcch_detector(const float sample_rate,
+   const unsigned int scan_len, const unsigned int D, const float p,
+   const float G) {
 
 	FILE *plan_fp;
 	char plan_name[BUFSIZ];
 	const char *home;
 
 
-	m_D = D;
-	m_p = p;
+	m_full_D = D;
+	m_full_p = p;
 	m_G = G;
 	m_e = 0.0;
 
@@ -70,19 +132,87 @@ fcch_detector::fcch_detector(const float sample_rate, const unsigned int D,
 	m_fcch_burst_len =
 	   (unsigned int)(148.0 * (m_sample_rate / GSM_RATE));
 
-	m_filter_delay = 8;
-	m_w_len = 2 * m_filter_delay + 1;
-	m_w = new complex[m_w_len];
-	memset(m_w, 0, sizeof(complex) * m_w_len);
+	m_w = 0;
+	m_w16 = 0;
+	m_w_i = 0;
+	m_w_q = 0;
+	m_x_cb = 0;
+	m_y_cb = 0;
+	filter_init(FILTER_DELAY, D, p);
+
+	q15_step(G, &m_g16, &m_shift);
+	m_e16 = 0;
+
+	m_decimation = 1;
+	m_lpf_len = 0;
+	m_lpf = 0;
+	m_d_len = 0;
+	m_d = 0;
+
+	m_engine = ENGINE_LMS;
+	m_gate = false;
+	m_noise_floor = 0.0;
+	m_block_limit = 0.0;
+	m_block_e = 0;
+	m_block_p = 0;
+
+	m_continuous = false;
+	m_found_at = 0;
+	m_burst_pos = 0.0;
+	m_s_pos = 0.0;
+	m_stft_len = 0;
+	m_stft_hop = 0;
+	m_stft_win = 0;
+	m_stft_in = 0;
+	m_stft_out = 0;
+	m_stft_plan = 0;
+	m_stft_peak = 0;
+	m_stft_pm = 0;
+	m_zoom_span = 0.0;
+	m_zoom_n = m_zoom_m = m_zoom_l = 0;
+	m_zoom_f0 = m_zoom_df = 0.0;
+	m_zoom_a = m_zoom_b = m_zoom_in = m_zoom_out = 0;
+	m_zoom_fwd = m_zoom_inv = 0;
+	m_fb_count = 0;
+	m_fb_in = 0;
+	m_fb_out = 0;
+	m_fb_plan = 0;
+	m_integrate = 1;
+	m_int_count = 0;
+	m_mf_len = 51 * 1250.0 * m_sample_rate / GSM_RATE;
+	m_fold_bins = 0;
+	m_fold_samples = 0.0;
+	m_fold_n = 0;
+	m_fold_peak = 0;
+	m_fold_pm = 0;
+	m_fold = 0;
+	m_acc = 0;
+	m_pfa = 0.0;
+	m_cfar_z = 0.0;
+	m_e_smooth = 0;
+	m_e_sum = 0;
+	m_e_sq = 0;
+	m_e_n = 0;
+	m_det_pm = 0.0;
+	m_det_pm_min = 0.0;
+	m_det_limit = 0.0;
+
+	m_cmp_count = m_cmp_lms = m_cmp_fft = m_cmp_both = 0;
+	m_cmp_ref = 0;
+	m_cmp_pos = 0.0;
+	m_ref = 0;
+	low_to_high_init();
+	m_cmp_diff = m_cmp_lms_t = m_cmp_fft_t = 0.0;
 
-	m_x_cb = new circular_buffer(8192, sizeof(complex), 0);
-	m_y_cb = new circular_buffer(8192, sizeof(complex), 1);
-	m_e_cb = new circular_buffer(1015808, sizeof(float), 0);
+	m_e_cb = new circular_buffer(scan_len? scan_len : E_CB_LEN,
+	   sizeof(float), 0);
+	reset();
 
 	m_in = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * FFT_SIZE);
 	m_out = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * FFT_SIZE);
 	if((!m_in) || (!m_out))
 		throw std::runtime_error("fcch_detector: fftw_malloc failed!");
+	pthread_mutex_lock(&fftw_mutex);
 #ifndef _WIN32
 	home = getenv("HOME");
 	if(strlen(home) + strlen(fftw_plan_name) + 2 < sizeof(plan_name)) {
@@ -103,17 +233,44 @@ fcch_detector::fcch_detector(const float sample_rate, const unsigned int D,
 #endif
 		m_plan = fftw_plan_dft_1d(FFT_SIZE, m_in, m_out, FFTW_FORWARD,
 		   FFTW_ESTIMATE);
+	pthread_mutex_unlock(&fftw_mutex);
 	if(!m_plan)
 		throw std::runtime_error("fcch_detector: fftw plan failed!");
+	m_fft = new complex[FFT_SIZE];
+
+	// so that find_burst() never allocates or plans
+	fb_init();
 }
 
 
 fcch_detector::~fcch_detector() {
 
+	// before taking fftw_mutex, which its destructor takes too
+	if(m_ref) {
+		delete m_ref;
+		m_ref = 0;
+	}
 	if(m_w) {
 		delete[] m_w;
 		m_w = 0;
 	}
+	if(m_w16) {
+		delete[] m_w16;
+		m_w16 = 0;
+	}
+	if(m_w_i) {
+		delete[] m_w_i;
+		delete[] m_w_q;
+		m_w_i = m_w_q = 0;
+	}
+	if(m_lpf) {
+		delete[] m_lpf;
+		m_lpf = 0;
+	}
+	if(m_d) {
+		delete[] m_d;
+		m_d = 0;
+	}
 	if(m_x_cb) {
 		delete m_x_cb;
 		m_x_cb = 0;
@@ -126,42 +283,108 @@ fcch_detector::~fcch_detector() {
 		delete m_e_cb;
 		m_e_cb = 0;
 	}
+	pthread_mutex_lock(&fftw_mutex);
+	if(m_plan) {
+		fftw_destroy_plan(m_plan);
+		m_plan = 0;
+	}
+	if(m_in) {
+		fftw_free(m_in);
+		m_in = 0;
+	}
+	if(m_out) {
+		fftw_free(m_out);
+		m_out = 0;
+	}
+	if(m_fft) {
+		delete[] m_fft;
+		m_fft = 0;
+	}
+	if(m_stft_plan) {
+		fftw_destroy_plan(m_stft_plan);
+		m_stft_plan = 0;
+	}
+	if(m_fb_plan) {
+		fftw_destroy_plan(m_fb_plan);
+		m_fb_plan = 0;
+	}
+	pthread_mutex_unlock(&fftw_mutex);
+	if(m_fb_in) {
+		fftw_free(m_fb_in);
+		m_fb_in = 0;
+	}
+	zoom_free();
+	if(m_fb_out) {
+		fftw_free(m_fb_out);
+		m_fb_out = 0;
+	}
+	if(m_stft_in) {
+		fftw_free(m_stft_in);
+		m_stft_in = 0;
+	}
+	if(m_stft_out) {
+		fftw_free(m_stft_out);
+		m_stft_out = 0;
+	}
+	if(m_stft_win) {
+		delete[] m_stft_win;
+		m_stft_win = 0;
+	}
+	if(m_stft_peak) {
+		delete[] m_stft_peak;
+		m_stft_peak = 0;
+	}
+	if(m_stft_pm) {
+		delete[] m_stft_pm;
+		m_stft_pm = 0;
+	}
+	if(m_block_e) {
+		delete[] m_block_e;
+		m_block_e = 0;
+	}
+	if(m_block_p) {
+		delete m_block_p;
+		m_block_p = 0;
+	}
+	delete[] m_acc;
+	delete[] m_fold;
+	delete[] m_fold_n;
+	delete[] m_fold_peak;
+	delete[] m_fold_pm;
+	delete[] m_e_smooth;
+	delete[] m_e_sum;
+	delete[] m_e_sq;
+	delete[] m_e_n;
 }
 
 
-enum {
-	LOW	= 0,
-	HIGH	= 1
-};
-
-static unsigned int g_count = 0,
-		    g_block_s = HIGH;
-
+void fcch_detector::low_to_high_init() {
 
-static inline void low_to_high_init() {
-
-	g_count = 0;
-	g_block_s = HIGH;
+	m_lh_count = 0;
+	m_lh_state = HIGH;
 }
 
 
-static inline unsigned int low_to_high(float e, float a) {
+/*
+ * Returns the length of a run of low errors when it ends, 0 otherwise.
+ */
+unsigned int fcch_detector::low_to_high(float e, float a) {
 
 	unsigned int r = 0;
 
 	if(e > a) {
-		if(g_block_s == LOW) {
-			r = g_count;
-			g_block_s = HIGH;
-			g_count = 0;
+		if(m_lh_state == LOW) {
+			r = m_lh_count;
+			m_lh_state = HIGH;
+			m_lh_count = 0;
 		}
-		g_count += 1;
+		m_lh_count += 1;
 	} else {
-		if(g_block_s == HIGH) {
-			g_block_s = LOW;
-			g_count = 0;
+		if(m_lh_state == HIGH) {
+			m_lh_state = LOW;
+			m_lh_count = 0;
 		}
-		g_count += 1;
+		m_lh_count += 1;
 	}
 
 	return r;
@@ -229,19 +452,10 @@ static inline complex interpolate_point(const complex *s, const unsigned int s_l
 
 static inline float peak_detect(const complex *s, const unsigned int s_len, complex *peak, float *avg_power) {
 
-	unsigned int i;
-	float max = -1.0, max_i = -1.0, sample_power, sum_power, early_i, late_i, incr;
+	float max_i, sum_power, early_i, late_i, incr;
 	complex early_p, late_p, cmax;
 
-	sum_power = 0;
-	for(i = 0; i < s_len; i++) {
-		sample_power = norm(s[i]);
-		sum_power += sample_power;
-		if(sample_power > max) {
-			max = sample_power;
-			max_i = i;
-		}
-	}
+	max_i = power_peak(s, s_len, 0, &sum_power);
 	early_i = (1 <= max_i)? (max_i - 1) : 0;
 	late_i = (max_i + 1 < s_len)? (max_i + 1) : s_len - 1;
 
@@ -300,197 +514,2108 @@ static inline unsigned int ftoi(float frequency, float sample_rate, unsigned int
 
 float fcch_detector::freq_detect(const complex *s, const unsigned int s_len, float *pm) {
 
+	fft_load(m_in, s, 0, s_len);
+
+	return transform_peak(s_len, pm);
+}
+
+
+/*
+ * freq_detect() for the fixed point path, which goes to floating point
+ * here, for the fft.
+ */
+float fcch_detector::freq_detect(const complex16 *s, const unsigned int s_len, float *pm) {
+
+	fft_load(m_in, 0, s, s_len);
+
+	return transform_peak(s_len, pm);
+}
+
+
+// the tone in the len samples loaded into m_in, zoomed in on if we can
+float fcch_detector::transform_peak(const unsigned int len, float *pm) {
+
+	if(m_zoom_m && (len <= m_zoom_n))
+		return zoom_peak(m_in, len, pm);
+
+	fftw_execute(m_plan);
+
+	return spectrum_peak(m_out, pm);
+}
+
+
+// copy s, or s16 if s is null, into an fft input and pad it with zeros
+void fcch_detector::fft_load(fftw_complex *in, const complex *s, const complex16 *s16, const unsigned int s_len) {
+
 	unsigned int i, len;
-	float max_i, avg_power;
-	complex fft[FFT_SIZE], peak;
 
 	len = MIN(s_len, FFT_SIZE);
-	for(i = 0; i < len; i++) {
-		m_in[i][0] = s[i].real();
-		m_in[i][1] = s[i].imag();
+	if(s) {
+		for(i = 0; i < len; i++) {
+			in[i][0] = s[i].real();
+			in[i][1] = s[i].imag();
+		}
+	} else {
+		for(i = 0; i < len; i++) {
+			in[i][0] = s16[i].i;
+			in[i][1] = s16[i].q;
+		}
 	}
 	for(i = len; i < FFT_SIZE; i++) {
-		m_in[i][0] = 0;
-		m_in[i][1] = 0;
+		in[i][0] = 0;
+		in[i][1] = 0;
 	}
+}
 
-	fftw_execute(m_plan);
+
+// the frequency and peak/mean of the strongest tone in an fft output
+float fcch_detector::spectrum_peak(const fftw_complex *out, float *pm) {
+
+	unsigned int i;
+	float max_i, avg_power;
+	complex peak;
 
 	for(i = 0; i < FFT_SIZE; i++) {
-		fft[i] = complex(m_out[i][0], m_out[i][1]);
+		m_fft[i] = complex(out[i][0], out[i][1]);
 	}
 
-	max_i = peak_detect(fft, FFT_SIZE, &peak, &avg_power);
+	max_i = peak_detect(m_fft, FFT_SIZE, &peak, &avg_power);
 	if(pm)
 		*pm = norm(peak) / avg_power;
 	return itof(max_i, m_sample_rate, FFT_SIZE);
 }
 
 
-static inline void display_complex(const complex *s, unsigned int s_len) {
+/*
+ * (Re)build the adaptive filter with filter_delay taps either side of the
+ * middle one, predicting D samples ahead and averaging its error over about
+ * 1 / p samples.  The taps start at zero.
+ */
+void fcch_detector::filter_init(unsigned int filter_delay, unsigned int D, float p) {
 
-	for(unsigned int i = 0; i < s_len; i++) {
-		printf("%f\n", s[i].real());
-		fprintf(stderr, "%f\n", s[i].imag());
-	}
+	delete[] m_w;
+	delete[] m_w16;
+	delete[] m_w_i;
+	delete[] m_w_q;
+	delete m_x_cb;
+	delete m_y_cb;
+
+	m_filter_delay = filter_delay;
+	m_w_len = 2 * m_filter_delay + 1;
+	m_D = D;
+	m_p = p;
+	m_w = new complex[m_w_len];
+	memset(m_w, 0, sizeof(complex) * m_w_len);
+	m_w16 = new complex16[m_w_len];
+	memset(m_w16, 0, sizeof(complex16) * m_w_len);
+	m_w_i = new float[m_w_len];
+	m_w_q = new float[m_w_len];
+	memset(m_w_i, 0, sizeof(float) * m_w_len);
+	memset(m_w_q, 0, sizeof(float) * m_w_len);
+	m_p_shift = (unsigned int)round(log2(1.0 / p));
+
+	// next_norm_error() needs get_delay() + 1 samples of history
+	m_x_cb = new circular_buffer(get_delay() + 1, sizeof(complex), 0);
+	m_y_cb = new circular_buffer(get_delay() + 1, sizeof(complex), 1);
+	m_x_power_valid = false;
 }
 
 
 /*
- * scan:
- * 	1.  calculate average error
- * 	2.  find neighborhoods with low error that satisfy minimum length
- * 	3.  for each such neighborhood, take fft and calculate peak/mean
- * 	4.  if peak/mean > 50, then this is a valid finding.
+ * Optional front end for the adaptive filter.  The FCCH tone sits near
+ * GSM_RATE / 4, so we mix that region down to baseband, low-pass filter it
+ * and keep every decimation'th sample.  The adaptive filter then only runs
+ * on the decimated samples, with its length, delay and error average scaled
+ * to cover the same time as at the input rate.  freq_detect() still works on
+ * the input samples so the offset scan() returns means the same thing either
+ * way.
+ *
+ * A decimation of 0 or 1 disables the front end.
  */
-unsigned int fcch_detector::scan(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed) {
+int fcch_detector::set_decimation(unsigned int decimation) {
 
-	static const float sps = m_sample_rate / (1625000.0 / 6.0);
-	static const unsigned int MIN_FB_LEN = 100 * sps;
-	static const unsigned int MIN_PM = 50; // XXX arbitrary, depends on decimation
+	static const float PASS_BAND = 50e3;	// OFFSET_MAX plus some margin
 
-	unsigned int len = 0, t, e_count, i, l_count, y_offset, y_len;
-	float e, *a, loff = 0, pm;
-	double sum = 0.0, avg, limit;
-	const complex *y;
+	unsigned int i, fd, D, half = decimation / 2;
+	float fc, c, w, sum, p;
 
-	// calculate the error for each sample
-	while(len < s_len) {
-		t = m_x_cb->write(s + len, 1);
-		len += t;
-		if(!next_norm_error(&e)) {
-			m_e_cb->write(&e, 1);
-			sum += e;
-		}
+	if(m_lpf) {
+		delete[] m_lpf;
+		m_lpf = 0;
 	}
-	if(consumed)
-		*consumed = len;
-
-	// calculate average error over entire buffer
-	a = (float *)m_e_cb->peek(&e_count);
-	avg = sum / (double)e_count;
-	limit = 0.7 * avg;
+	if(m_d) {
+		delete[] m_d;
+		m_d = 0;
+	}
+	m_decimation = 1;
+	m_lpf_len = 0;
+	m_d_len = 0;
+	filter_init(FILTER_DELAY, m_full_D, m_full_p);
 
-	if(g_debug) {
-		printf("debug: error limit: %.1lf\n", limit);
+	if(decimation <= 1) {
+		ref_init();
+		return 0;
 	}
 
-	// find neighborhoods where the error is smaller than the limit
-	low_to_high_init();
-	for(i = 0; i < e_count; i++) {
-		l_count = low_to_high(a[i], limit);
+	// the decimated rate must still hold the whole search range
+	if(m_sample_rate / decimation < 2 * PASS_BAND) {
+		fprintf(stderr, "error: fcch_detector: decimation %u too large "
+		   "for sample rate %.0f\n", decimation, m_sample_rate);
+		ref_init();
+		return -1;
+	}
 
-		// see if p/m indicates a pure tone
-		pm = 0;
-		if(l_count >= MIN_FB_LEN) {
-			y_offset = i - l_count;
-			y_len = (l_count < m_fcch_burst_len)? l_count : m_fcch_burst_len;
-			y = s + y_offset;
-			loff = freq_detect(y, y_len, &pm);
-			if(g_debug)
-				printf("debug: %.0f\t%f\t%f\n", (double)l_count / sps, pm, loff);
-			if(pm > MIN_PM)
-				break;
-		}
+	// windowed-sinc low-pass, cutoff at 80% of the decimated nyquist
+	m_lpf_len = 8 * decimation + 1;
+	m_lpf = new complex[m_lpf_len];
+	fc = 0.4 / decimation;
+	c = (m_lpf_len - 1) / 2.0;
+	sum = 0.0;
+	for(i = 0; i < m_lpf_len; i++) {
+		w = 0.54 - 0.46 * cos(2.0 * M_PI * i / (m_lpf_len - 1));
+		m_lpf[i] = w * 2.0 * fc * sinc(2.0 * M_PI * fc * (i - c));
+		sum += m_lpf[i].real();
 	}
-	// empty buffers for next call
-	m_e_cb->flush();
-	m_x_cb->flush();
-	m_y_cb->flush();
 
-	if(pm <= MIN_PM)
-		return 0;
+	// fold the mixer's per-tap phase into the taps
+	for(i = 0; i < m_lpf_len; i++)
+		m_lpf[i] = (m_lpf[i] / sum) * std::polar(1.0f,
+		   (float)(-2.0 * M_PI * (GSM_RATE / 4.0) * i / m_sample_rate));
 
-	if(offset)
-		*offset = loff;
+	m_decimation = decimation;
+	m_d_len = m_e_cb->buf_len() / decimation + 1;
+	m_d = new complex[m_d_len];
 
-	if(g_debug) {
-		printf("debug: fcch_detector finished -----------------------------\n");
-	}
+	fd = (FILTER_DELAY + half) / decimation;
+	D = (m_full_D + half) / decimation;
+	p = m_full_p * decimation;
+	filter_init((fd < 2)? 2 : fd, D? D : 1, (p < 0.5)? p : 0.5);
+	ref_init();
 
-	return 1;
+	return 0;
 }
 
 
-unsigned int fcch_detector::update(const complex *s, const unsigned int s_len) {
+/*
+ * ENGINE_COMPARE with the front end on also runs the adaptive filter at the
+ * input rate, so print_compare() can show where the two put the bursts.
+ */
+void fcch_detector::ref_init() {
+
+	if((m_engine == ENGINE_COMPARE) && (m_decimation > 1)) {
+		if(!m_ref)
+			m_ref = new fcch_detector(m_sample_rate,
+			   m_e_cb->buf_len(), m_full_D, m_full_p, m_G);
+	} else if(m_ref) {
+		delete m_ref;
+		m_ref = 0;
+	}
+}
 
-	return m_x_cb->write(s, s_len);
+
+/*
+ * Mix, filter and decimate s into m_d.  With the mixer folded into the
+ * taps, output k is
+ *
+ * 	d[k] = exp(-j * w0 * k * decimation) * sum(lpf[i] * s[k * decimation + i])
+ *
+ * so we only ever compute the samples we keep.
+ */
+unsigned int fcch_detector::mix_decimate(const complex *s, const unsigned int s_len) {
+
+	unsigned int i, k, n;
+	complex acc, nco, step;
+
+	step = std::polar(1.0f,
+	   (float)(-2.0 * M_PI * (GSM_RATE / 4.0) * m_decimation / m_sample_rate));
+	nco = 1.0;
+	for(k = 0, n = 0; (n + m_lpf_len <= s_len) && (k < m_d_len); k++, n += m_decimation) {
+		acc = 0.0;
+		for(i = 0; i < m_lpf_len; i++)
+			acc += m_lpf[i] * s[n + i];
+		m_d[k] = nco * acc;
+
+		// keep the oscillator on the unit circle
+		nco *= step;
+		if(!(k & 0xff))
+			nco /= abs(nco);
+	}
+
+	return k;
 }
 
 
-unsigned int fcch_detector::get_delay() {
+static inline void display_complex(const complex *s, unsigned int s_len) {
 
-	return m_w_len - 1 + m_D;
+	for(unsigned int i = 0; i < s_len; i++) {
+		printf("%f\n", s[i].real());
+		fprintf(stderr, "%f\n", s[i].imag());
+	}
 }
 
 
-unsigned int fcch_detector::filter_len() {
+/*
+ * Select the detection engine used by scan().  The fft engine needs its own
+ * plan and buffers, which are allocated the first time it is selected.
+ */
+int fcch_detector::set_engine(int engine) {
 
-	return m_w_len;
+	if((engine < ENGINE_LMS) || (engine > ENGINE_COMPARE))
+		return -1;
+	m_engine = engine;
+	if(engine != ENGINE_LMS)
+		stft_init();
+	ref_init();
+
+	return 0;
 }
 
 
-static float vectornorm2(const complex *v, const unsigned int len) {
+/*
+ * Short-time fft plan and buffers, shared by the fft engine and the
+ * multiframe fold.
+ */
+void fcch_detector::stft_init() {
 
 	unsigned int i;
-	float e = 0.0;
+	int n;
+
+	if(m_stft_plan)
+		return;
+
+	// windows of about 64 symbols, overlapped by three quarters
+	for(m_stft_len = 1; m_stft_len < 64 * m_sample_rate / GSM_RATE;
+	   m_stft_len <<= 1);
+	m_stft_hop = m_stft_len / 4;
 
-	for(i = 0; i < len; i++)
-		e += norm(v[i]);
+	m_stft_win = new float[m_stft_len];
+	for(i = 0; i < m_stft_len; i++)
+		m_stft_win[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / m_stft_len);
 
-	return e;
+	m_stft_peak = new unsigned int[m_e_cb->buf_len() / m_stft_hop + 1];
+	m_stft_pm = new float[m_e_cb->buf_len() / m_stft_hop + 1];
+
+	m_stft_in = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) *
+	   m_stft_len * STFT_BATCH);
+	m_stft_out = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) *
+	   m_stft_len * STFT_BATCH);
+	if((!m_stft_in) || (!m_stft_out))
+		throw std::runtime_error("fcch_detector: fftw_malloc failed!");
+
+	n = m_stft_len;
+	pthread_mutex_lock(&fftw_mutex);
+	m_stft_plan = fftw_plan_many_dft(1, &n, STFT_BATCH, m_stft_in, 0, 1, n,
+	   m_stft_out, 0, 1, n, FFTW_FORWARD, FFTW_MEASURE);
+	pthread_mutex_unlock(&fftw_mutex);
+	if(!m_stft_plan)
+		throw std::runtime_error("fcch_detector: fftw plan failed!");
 }
 
 
 /*
- * First y value comes out at sample x[n + m_D] = x[w_len - 1 + m_D].
+ * The z for which a standard normal exceeds z with probability p < 0.5
+ * (Abramowitz and Stegun 26.2.23, good to 4.5e-4).
+ */
+static double normal_quantile(const double p) {
+
+	double t = sqrt(-2.0 * log(p));
+
+	return t - (2.515517 + 0.802853 * t + 0.010328 * t * t) /
+	   (1.0 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+}
+
+
+/*
+ * Constant false alarm rate mode:  instead of the fixed MIN_PM and an error
+ * limit from the average over the whole capture, derive both thresholds
+ * from pfa, the probability that noise alone makes it through both the
+ * error stage and freq_detect(), with the error limit set from the
+ * statistics of the errors around each sample.  0 goes back to the fixed
+ * thresholds.
+ */
+int fcch_detector::set_pfa(double pfa) {
+
+	if((pfa < 0.0) || (pfa >= 1.0))
+		return -1;
+	m_pfa = pfa;
+	if(pfa <= 0.0)
+		return 0;
+
+	// split the rate between the error stage and the peak/mean stage
+	m_cfar_z = normal_quantile(sqrt(pfa));
+	if(!m_e_sum) {
+		m_e_smooth = new float[m_e_cb->buf_len()];
+		m_e_sum = new double[m_e_cb->buf_len() + 1];
+		m_e_sq = new double[m_e_cb->buf_len() + 1];
+		m_e_n = new unsigned int[m_e_cb->buf_len() + 1];
+	}
+
+	return 0;
+}
+
+
+/*
+ * The peak/mean a tone has to reach in the spectrum of len samples.
  *
- * 	y[0] = X(x[0], ..., x[w_len - 1 + m_D])
+ * For noise alone, freq_detect() sees about len independent bins of
+ * exponentially distributed power.  The chance that the largest is more
+ * than T times the mean is about len * exp(-T).  This stage gets sqrt(pfa)
+ * of the rate, the error stage the other factor, so T = ln(len / sqrt(pfa)).
+ * Traffic is not white and the peak is interpolated, so this is a floor
+ * rather than an exact rate; thresholds() lets it be tuned against what
+ * real detections see.
+ */
+float fcch_detector::pm_threshold(const unsigned int len) {
+
+	const unsigned int n = (len < FFT_SIZE)? len : FFT_SIZE;
+
+	if(m_pfa <= 0.0)
+		return MIN_PM;
+	return logf(n / sqrt(m_pfa));
+}
+
+
+/*
+ * The peak/mean a short-time fft window has to reach.
  *
- * So y and e are delayed by w_len - 1 + m_D.
+ * The mean leaves out the peak and its neighbours and, with the window
+ * correlating neighbouring bins, is only an average of about
+ * v = (m_stft_len - 5) / 1.5 independent bins.  So rather than
+ * m_stft_len * exp(-T), noise gets past T with probability about
+ *
+ * 	m_stft_len * (1 + T / v)^-v
+ *
+ * which is within 25% of what 64-bin windows of noise measure for T from 6
+ * to 12.  Like the error stage of the lms engine, the windows get sqrt(pfa)
+ * of the rate.
  */
-int fcch_detector::next_norm_error(float *error) {
+float fcch_detector::win_threshold() {
 
-	unsigned int i, n, max;
-	float E;
-	complex *x, y, e;
+	const double v = (m_stft_len - 5) / 1.5;
 
-	// n is "current" sample
-	n = m_w_len - 1;
+	if(m_pfa <= 0.0)
+		return MIN_WIN_PM;
+	return v * (pow(m_stft_len / sqrt(m_pfa), 1.0 / v) - 1.0);
+}
 
-	// ensure there are enough samples in the buffer
-	x = (complex *)m_x_cb->peek(&max);
-	if(n + m_D >= max)
-		return n + m_D - max + 1;
 
-	// update G
-	E = vectornorm2(x, m_w_len);
-	if(m_G >= 2.0 / E)
-		m_G = 1.0 / E;
+void fcch_detector::record(float pm, float pm_min, float limit) {
 
-	// calculate filtered value
-	y = 0.0;
-	for(i = 0; i < m_w_len; i++)
-		y += std::conj(m_w[i]) * x[n - i];
-	// m_y_cb->write(&y, 1);
-	m_y_cb->write(x + n + m_D, 1); // XXX save filtered value?
+	m_det_pm = pm;
+	m_det_pm_min = pm_min;
+	m_det_limit = limit;
+}
 
-	// calculate error from desired signal
-	e = x[n + m_D] - y;
 
-	// update filters with opposite gradient
-	for(i = 0; i < m_w_len; i++)
-		m_w[i] += m_G * std::conj(e) * x[n - i];
+/*
+ * The peak/mean, the threshold it had to beat and, for the lms engine, the
+ * error limit of the last detection.
+ */
+void fcch_detector::thresholds(float *pm, float *pm_min, float *limit) {
 
-	// update error average power
-	E /= m_w_len;
-	m_e = (1.0 - m_p) * m_e + m_p * norm(e);
+	if(pm)
+		*pm = m_det_pm;
+	if(pm_min)
+		*pm_min = m_det_pm_min;
+	if(limit)
+		*limit = m_det_limit;
+}
 
-	// return error ratio
-	if(error)
-		*error = m_e / E;
 
-	// remove the processed sample from the buffer
+/*
+ * Smooth the errors over CFAR_SMOOTH symbols, leaving out windows that
+ * touch a block the energy gate skipped, and keep running sums of the
+ * smoothed errors and their squares so local_error() is a few
+ * subtractions.
+ */
+void fcch_detector::local_error_init(const float *a, const unsigned int a_len) {
+
+	unsigned int w = (unsigned int)(CFAR_SMOOTH * m_sample_rate / GSM_RATE) /
+	   m_decimation;
+	unsigned int i, n = 0;
+	double sum = 0.0, e;
+
+	if(!w)
+		w = 1;
+	m_e_sum[0] = 0.0;
+	m_e_sq[0] = 0.0;
+	m_e_n[0] = 0;
+	for(i = 0; i < a_len; i++) {
+		if(a[i] < SKIPPED_ERROR) {
+			sum += a[i];
+			n += 1;
+		}
+		if(i >= w) {
+			if(a[i - w] < SKIPPED_ERROR) {
+				sum -= a[i - w];
+				n -= 1;
+			}
+		}
+		m_e_smooth[i] = ((i + 1 >= w) && (n == w))? sum / w : SKIPPED_ERROR;
+
+		m_e_sum[i + 1] = m_e_sum[i];
+		m_e_sq[i + 1] = m_e_sq[i];
+		m_e_n[i + 1] = m_e_n[i];
+		if(m_e_smooth[i] < SKIPPED_ERROR) {
+			e = m_e_smooth[i];
+			m_e_sum[i + 1] += e;
+			m_e_sq[i + 1] += e * e;
+			m_e_n[i + 1] += 1;
+		}
+	}
+}
+
+
+/*
+ * Cell-averaging:  the mean and spread of the smoothed error over two
+ * bursts on each side of error i, leaving out a burst either side of it so
+ * a frequency burst doesn't move its own limit.  The limit is m_cfar_z
+ * standard deviations below the mean.  Near the ends of a short capture
+ * there may not be enough reference cells, so fall back to limit.
+ */
+double fcch_detector::local_error(const unsigned int i, const unsigned int a_len, const double limit) {
+
+	const unsigned int guard = m_fcch_burst_len / m_decimation;
+	const unsigned int ref = 2 * guard;
+
+	unsigned int lo, hi, n = 0;
+	double sum = 0.0, sq = 0.0, mean, var;
+
+	if(i > guard) {
+		hi = i - guard;
+		lo = (hi > ref)? hi - ref : 0;
+		sum += m_e_sum[hi] - m_e_sum[lo];
+		sq += m_e_sq[hi] - m_e_sq[lo];
+		n += m_e_n[hi] - m_e_n[lo];
+	}
+	if(i + guard + 1 < a_len) {
+		lo = i + guard + 1;
+		hi = (lo + ref < a_len)? lo + ref : a_len;
+		sum += m_e_sum[hi] - m_e_sum[lo];
+		sq += m_e_sq[hi] - m_e_sq[lo];
+		n += m_e_n[hi] - m_e_n[lo];
+	}
+	if(n < ref)
+		return limit;
+
+	mean = sum / n;
+	var = sq / n - mean * mean;
+	return mean - m_cfar_z * sqrt((var > 0.0)? var : 0.0);
+}
+
+
+/*
+ * Enable the phase-difference gate in front of the detection engine.
+ */
+void fcch_detector::set_gate(bool enable) {
+
+	m_gate = enable;
+}
+
+/*
+ * Look for the tone only within span of GSM_RATE / 4, with a chirp-z
+ * transform, instead of across the whole spectrum.  Callers that throw away
+ * offsets further out than that lose nothing and get a finer, exactly
+ * evaluated peak for fewer flops.  A span of 0 goes back to the full fft.
+ */
+int fcch_detector::set_zoom(float span) {
+
+	unsigned int n, bins;
+	int l;
+	double theta, ph;
+
+	zoom_free();
+	if(span <= 0.0)
+		return 0;
+	if((span >= GSM_RATE / 4) || (GSM_RATE / 4 + span >= m_sample_rate / 2))
+		return -1;
+
+	/*
+	 * The band takes at least as many bins as the full fft would give
+	 * it, rounded up to fill whatever fft length the bursts need.
+	 */
+	m_zoom_n = m_fcch_burst_len;
+	bins = (unsigned int)ceil(2 * span / (m_sample_rate / FFT_SIZE)) + 1;
+	for(m_zoom_l = 1; m_zoom_l < m_zoom_n + bins - 1; m_zoom_l <<= 1);
+	m_zoom_m = m_zoom_l - m_zoom_n + 1;
+	m_zoom_f0 = GSM_RATE / 4 - span;
+	m_zoom_df = 2 * span / (m_zoom_m - 1);
+	m_zoom_span = span;
+
+	m_zoom_a = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * m_zoom_n);
+	m_zoom_b = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * m_zoom_l);
+	m_zoom_in = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * m_zoom_l);
+	m_zoom_out = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * m_zoom_l);
+	if((!m_zoom_a) || (!m_zoom_b) || (!m_zoom_in) || (!m_zoom_out))
+		throw std::runtime_error("fcch_detector: fftw_malloc failed!");
+
+	l = m_zoom_l;
+	pthread_mutex_lock(&fftw_mutex);
+	m_zoom_fwd = fftw_plan_dft_1d(l, m_zoom_in, m_zoom_out, FFTW_FORWARD,
+	   FFTW_MEASURE);
+	m_zoom_inv = fftw_plan_dft_1d(l, m_zoom_in, m_zoom_out, FFTW_BACKWARD,
+	   FFTW_MEASURE);
+	pthread_mutex_unlock(&fftw_mutex);
+	if((!m_zoom_fwd) || (!m_zoom_inv))
+		throw std::runtime_error("fcch_detector: fftw plan failed!");
+
+	/*
+	 * With theta = 2 pi df / fs and nk = (n^2 + k^2 - (k - n)^2) / 2,
+	 *
+	 * 	X(f0 + k df) = sum(x[n] a[n] b[k - n]) conj(b[k])
+	 *
+	 * 	a[n] = exp(-j (2 pi f0 n / fs + theta n^2 / 2))
+	 * 	b[m] = exp(j theta m^2 / 2)
+	 *
+	 * and the sum is a convolution, done as a circular one m_zoom_l
+	 * long.  b runs from -(m_zoom_n - 1) to m_zoom_m - 1; we keep its
+	 * transform.  |conj(b[k])| is 1 so the peak search leaves it out.
+	 */
+	theta = 2.0 * M_PI * m_zoom_df / m_sample_rate;
+	for(n = 0; n < m_zoom_n; n++) {
+		ph = 2.0 * M_PI * m_zoom_f0 * n / m_sample_rate +
+		   theta * n * n / 2.0;
+		m_zoom_a[n][0] = cos(ph);
+		m_zoom_a[n][1] = -sin(ph);
+	}
+	for(n = 0; n < m_zoom_l; n++) {
+		m_zoom_in[n][0] = 0.0;
+		m_zoom_in[n][1] = 0.0;
+	}
+	for(n = 0; n < m_zoom_m; n++) {
+		ph = theta * n * n / 2.0;
+		m_zoom_in[n][0] = cos(ph);
+		m_zoom_in[n][1] = sin(ph);
+	}
+	for(n = 1; n < m_zoom_n; n++) {
+		ph = theta * n * n / 2.0;
+		m_zoom_in[m_zoom_l - n][0] = cos(ph);
+		m_zoom_in[m_zoom_l - n][1] = sin(ph);
+	}
+	fftw_execute(m_zoom_fwd);
+	memcpy(m_zoom_b, m_zoom_out, sizeof(fftw_complex) * m_zoom_l);
+
+	return 0;
+}
+
+
+void fcch_detector::zoom_free() {
+
+	pthread_mutex_lock(&fftw_mutex);
+	if(m_zoom_fwd) {
+		fftw_destroy_plan(m_zoom_fwd);
+		m_zoom_fwd = 0;
+	}
+	if(m_zoom_inv) {
+		fftw_destroy_plan(m_zoom_inv);
+		m_zoom_inv = 0;
+	}
+	pthread_mutex_unlock(&fftw_mutex);
+	if(m_zoom_a) {
+		fftw_free(m_zoom_a);
+		m_zoom_a = 0;
+	}
+	if(m_zoom_b) {
+		fftw_free(m_zoom_b);
+		m_zoom_b = 0;
+	}
+	if(m_zoom_in) {
+		fftw_free(m_zoom_in);
+		m_zoom_in = 0;
+	}
+	if(m_zoom_out) {
+		fftw_free(m_zoom_out);
+		m_zoom_out = 0;
+	}
+	m_zoom_span = 0.0;
+	m_zoom_m = 0;
+}
+
+
+// |X(f)|^2 of the len samples x, with the rotation done by recurrence
+static double dtft_power(const fftw_complex *x, const unsigned int len, const double f, const double fs) {
+
+	unsigned int n;
+	double re = 0.0, im = 0.0, w_re, w_im, r_re = 1.0, r_im = 0.0, t;
+
+	w_re = cos(2.0 * M_PI * f / fs);
+	w_im = -sin(2.0 * M_PI * f / fs);
+	for(n = 0; n < len; n++) {
+		re += x[n][0] * r_re - x[n][1] * r_im;
+		im += x[n][0] * r_im + x[n][1] * r_re;
+		t = r_re * w_re - r_im * w_im;
+		r_im = r_re * w_im + r_im * w_re;
+		r_re = t;
+	}
+
+	return re * re + im * im;
+}
+
+
+// offset, in steps, of the top of the parabola through p_l, p and p_r
+static double parabola_peak(const double p_l, const double p, const double p_r) {
+
+	double d = p_l - 2.0 * p + p_r;
+
+	return (d < 0.0)? 0.5 * (p_l - p_r) / d : 0.0;
+}
+
+
+/*
+ * zoom_peak:
+ * 	1.  chirp-z transform the len <= m_zoom_n samples x onto the m_zoom_m
+ * 	    bins of the band
+ * 	2.  fit a parabola to the strongest bin and its neighbours; the bins
+ * 	    are close enough that the top of the main lobe is nearly one
+ * 	3.  fit again to the exact spectrum around that frequency and
+ * 	    evaluate it there
+ *
+ * 	The peak/mean is taken against the mean of a FFT_SIZE point fft,
+ * 	which is the energy of x, so the thresholds are the same as for the
+ * 	full fft.  A peak on the edge of the band is a tone outside it and
+ * 	gets a peak/mean of 0.
+ */
+float fcch_detector::zoom_peak(const fftw_complex *x, const unsigned int len, float *pm) {
+
+	unsigned int n, k, max_k = 0;
+	double re, im, p, max_p = -1.0, e = 0.0, f, h, p_l, p_r;
+
+	for(n = 0; n < len; n++) {
+		m_zoom_in[n][0] = x[n][0] * m_zoom_a[n][0] - x[n][1] * m_zoom_a[n][1];
+		m_zoom_in[n][1] = x[n][0] * m_zoom_a[n][1] + x[n][1] * m_zoom_a[n][0];
+		e += x[n][0] * x[n][0] + x[n][1] * x[n][1];
+	}
+	for(; n < m_zoom_l; n++) {
+		m_zoom_in[n][0] = 0.0;
+		m_zoom_in[n][1] = 0.0;
+	}
+	fftw_execute(m_zoom_fwd);
+	for(n = 0; n < m_zoom_l; n++) {
+		re = m_zoom_out[n][0] * m_zoom_b[n][0] - m_zoom_out[n][1] * m_zoom_b[n][1];
+		im = m_zoom_out[n][0] * m_zoom_b[n][1] + m_zoom_out[n][1] * m_zoom_b[n][0];
+		m_zoom_in[n][0] = re;
+		m_zoom_in[n][1] = im;
+	}
+	fftw_execute(m_zoom_inv);
+
+	for(k = 0; k < m_zoom_m; k++) {
+		p = m_zoom_out[k][0] * m_zoom_out[k][0] + m_zoom_out[k][1] * m_zoom_out[k][1];
+		if(p > max_p) {
+			max_p = p;
+			max_k = k;
+		}
+	}
+	if((max_k == 0) || (max_k == m_zoom_m - 1)) {
+		if(pm)
+			*pm = 0.0;
+		return m_zoom_f0 + max_k * m_zoom_df;
+	}
+
+	p_l = m_zoom_out[max_k - 1][0] * m_zoom_out[max_k - 1][0] +
+	   m_zoom_out[max_k - 1][1] * m_zoom_out[max_k - 1][1];
+	p_r = m_zoom_out[max_k + 1][0] * m_zoom_out[max_k + 1][0] +
+	   m_zoom_out[max_k + 1][1] * m_zoom_out[max_k + 1][1];
+	f = m_zoom_f0 + (max_k + parabola_peak(p_l, max_p, p_r)) * m_zoom_df;
+
+	// and once more on the exact spectrum a quarter bin either side
+	h = m_zoom_df / 4;
+	p_l = dtft_power(x, len, f - h, m_sample_rate);
+	p = dtft_power(x, len, f, m_sample_rate);
+	p_r = dtft_power(x, len, f + h, m_sample_rate);
+	f += parabola_peak(p_l, p, p_r) * h;
+	p = dtft_power(x, len, f, m_sample_rate);
+
+	if(pm)
+		*pm = p / ((FFT_SIZE * e - p) / (FFT_SIZE - 1));
+	return f;
+}
+
+
+/*
+ * scan:
+ * 	look for a frequency burst in s.  Unless the detector is in continuous
+ * 	mode each call stands alone.
+ */
+unsigned int fcch_detector::scan(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed) {
+
+	if(m_continuous)
+		return scan_stream(s, s_len, offset, consumed);
+	return scan_capture(s, s_len, offset, consumed);
+}
+
+
+/*
+ * Continuous mode:  s is the continuation of the samples passed to the last
+ * scan(), less the ones it reported as consumed.  The caller must consume
+ * exactly that many and call reset() whenever the stream is broken (e.g.,
+ * after an overrun or a retune).
+ */
+void fcch_detector::set_continuous(bool enable) {
+
+	m_continuous = enable;
+	reset();
+}
+
+
+/*
+ * Forget the stream: sample position, filter history, error average and any
+ * lock on the multiframe.  A detector reused for another channel should be
+ * reset first; the taps and step carry over and adapt within a few samples.
+ * Nothing is allocated, so one detector per thread serves a whole scan.
+ */
+void fcch_detector::reset() {
+
+	m_x_cb->flush();
+	m_x_power_valid = false;
+	m_pos = 0.0;
+	m_e_avg = 0.0;
+	m_locked = false;
+	m_mf_index = -1;
+	m_run10 = 0;
+	m_cand = 0;
+	m_misses = 0;
+	m_int_count = 0;
+	m_fold_samples = 0.0;
+	if(m_acc)
+		memset(m_acc, 0, sizeof(float) * (2 * TRACK_STEPS + 1) * FFT_SIZE);
+	if(m_fold) {
+		memset(m_fold, 0, sizeof(float) * m_fold_bins * m_stft_len);
+		memset(m_fold_n, 0, sizeof(unsigned int) * m_fold_bins);
+	}
+}
+
+
+/*
+ * Integration:  for towers too weak for a single burst, average the power
+ * spectra of n bursts before looking for the tone.  Only in continuous mode.
+ * Acquisition folds n multiframes of short-time spectra onto one, which finds
+ * the frequency bursts and where in the multiframe they are.  Each offset
+ * reported is then from the average spectrum of n predicted bursts.
+ */
+int fcch_detector::set_integrate(unsigned int n) {
+
+	if(!n)
+		return -1;
+	m_integrate = n;
+	if((n > 1) && (!m_acc)) {
+		stft_init();
+		m_acc = new float[(2 * TRACK_STEPS + 1) * FFT_SIZE];
+		m_fold_bins = (unsigned int)ceil(m_mf_len / m_stft_hop);
+		m_fold = new float[m_fold_bins * m_stft_len];
+		m_fold_n = new unsigned int[m_fold_bins];
+		m_fold_peak = new unsigned int[m_fold_bins + 1];
+		m_fold_pm = new float[m_fold_bins + 1];
+	}
+	reset();
+
+	return 0;
+}
+
+
+/*
+ * The absolute sample index of the next predicted frequency burst, if we
+ * are locked onto the multiframe.
+ */
+int fcch_detector::next_burst(double *pos) {
+
+	const double frame = 1250.0 * m_sample_rate / GSM_RATE;
+
+	unsigned int gap;
+
+	if(!m_locked)
+		return 0;
+	gap = (m_mf_index < 0)? 10 + m_cand : ((m_mf_index == 4)? 11 : 10);
+	if(pos)
+		*pos = m_burst_pos + gap * frame;
+
+	return 1;
+}
+
+
+/*
+ * When locked, how many samples past the current stream position hold
+ * nothing of interest (skip) and how many must then be passed to scan() to
+ * cover the predicted burst and the alignments tried around it (len).
+ */
+int fcch_detector::next_window(unsigned int *skip, unsigned int *len) {
+
+	const unsigned int margin = TRACK_STEPS * (m_fcch_burst_len / 16);
+
+	double p;
+
+	if(!next_burst(&p))
+		return 0;
+	p -= m_pos + margin;
+	if(p < 0)
+		p = 0;
+	if(skip)
+		*skip = (unsigned int)p;
+	if(len)
+		*len = (unsigned int)ceil(p - floor(p)) + 2 * margin +
+		   m_fcch_burst_len + 1;
+
+	return 1;
+}
+
+
+/*
+ * The caller dropped len samples of the stream without passing them to
+ * scan().
+ */
+void fcch_detector::skip(unsigned int len) {
+
+	m_pos += len;
+}
+
+
+/*
+ * Someone else (e.g., sch_detector) knows better where the last burst
+ * started, as an index into the samples passed to scan().
+ */
+void fcch_detector::align(double burst_pos) {
+
+	if(m_continuous && m_locked)
+		m_burst_pos = m_s_pos + burst_pos;
+}
+
+
+/*
+ * scan_stream:
+ * 	until we have found a burst, scan each capture as usual but keep the
+ * 	adaptive filter history and error average between calls.
+ *
+ * 	Once a burst has been found we know where the next ones are.  In the
+ * 	51-frame multiframe the FCCH is in frames 0, 10, 20, 30 and 40, so
+ * 	the next burst is 10 frames on, or 11 after frame 40.  Until an
+ * 	11-frame gap (or four 10-frame gaps in a row) tells us where in the
+ * 	multiframe we are, we try both.  Only the predicted window is
+ * 	examined, with a few freq_detect() calls around the prediction to
+ * 	follow the timing.  After TRACK_MISS_MAX misses in a row we go back
+ * 	to scanning.
+ */
+unsigned int fcch_detector::scan_stream(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed) {
+
+	const double frame = 1250.0 * m_sample_rate / GSM_RATE;
+	const unsigned int step = m_fcch_burst_len / 16;
+	const unsigned int y_len = m_fcch_burst_len - 2 * step;
+
+	unsigned int r, gap, used, best_i = 0;
+	int k;
+	double p;
+	float f, pm, best_f = 0.0, best_pm = 0.0;
+
+	m_s_pos = m_pos;
+	if((!m_locked) && (m_integrate > 1))
+		return scan_fold(s, s_len, consumed);
+	if(!m_locked) {
+		m_found_at = 0;
+		r = scan_capture(s, s_len, offset, &used);
+		if(r) {
+			m_locked = true;
+			m_burst_pos = m_pos + m_found_at;
+			m_mf_index = -1;
+			m_run10 = 0;
+			m_cand = 0;
+			m_misses = 0;
+			used = m_found_at + m_fcch_burst_len;
+			if(used > s_len)
+				used = s_len;
+		}
+		m_pos += used;
+		if(consumed)
+			*consumed = used;
+		return r;
+	}
+
+	for(;;) {
+		next_burst(&p);
+		gap = (m_mf_index < 0)? 10 + m_cand : ((m_mf_index == 4)? 11 : 10);
+		p -= m_pos;
+
+		// the window must be in this capture; wait for it if it's later
+		if(p - TRACK_STEPS * step < 0) {
+			reset();
+			if(consumed)
+				*consumed = 0;
+			return 0;
+		}
+		if(p + TRACK_STEPS * step + m_fcch_burst_len > s_len) {
+			used = (unsigned int)(p - TRACK_STEPS * step);
+			if(used > s_len)
+				used = s_len;
+			m_pos += used;
+			if(consumed)
+				*consumed = used;
+			return 0;
+		}
+
+		// integrating: add the window to the sums and move on
+		if(m_integrate > 1) {
+			for(k = -(int)TRACK_STEPS; k <= (int)TRACK_STEPS; k++)
+				power_spectrum(s + (int)p + k * (int)step + step, y_len,
+				   m_acc + (k + TRACK_STEPS) * FFT_SIZE);
+			m_burst_pos += gap * frame;
+			m_mf_index = (m_mf_index + 1) % 5;
+			m_found_at = (unsigned int)p;
+			used = (unsigned int)p + TRACK_STEPS * step + m_fcch_burst_len;
+			m_pos += used;
+			if(consumed)
+				*consumed = used;
+			if(++m_int_count < m_integrate)
+				return 0;
+			return integrated(offset);
+		}
+
+		// try a few alignments around the prediction
+		best_pm = 0.0;
+		for(k = -(int)TRACK_STEPS; k <= (int)TRACK_STEPS; k++) {
+			f = freq_detect(s + (int)p + k * (int)step + step, y_len, &pm);
+			if(pm > best_pm) {
+				best_pm = pm;
+				best_f = f;
+				best_i = (int)p + k * (int)step;
+			}
+		}
+		if(g_debug)
+			printf("debug: track: gap %u\t%f\t%f\n", gap, best_pm, best_f);
+
+		if(best_pm > pm_threshold(y_len)) {
+			record(best_pm, pm_threshold(y_len), 0.0);
+			m_burst_pos = m_pos + best_i;
+			m_found_at = best_i;
+			if(m_mf_index >= 0) {
+				m_mf_index = (m_mf_index + 1) % 5;
+			} else if(gap == 11) {
+				m_mf_index = 0;
+			} else if(++m_run10 == 4) {
+				m_mf_index = 4;
+			}
+			m_cand = 0;
+			m_misses = 0;
+
+			used = best_i + m_fcch_burst_len;
+			m_pos += used;
+			if(consumed)
+				*consumed = used;
+			if(offset)
+				*offset = best_f;
+			return 1;
+		}
+
+		// missed; without the multiframe position try the other gap
+		if((m_mf_index < 0) && (!m_cand)) {
+			m_cand = 1;
+			continue;
+		}
+		if((m_mf_index < 0) || (++m_misses > TRACK_MISS_MAX)) {
+			reset();
+			if(consumed)
+				*consumed = 0;
+			return 0;
+		}
+
+		// step over the missing burst
+		m_burst_pos += gap * frame;
+		m_mf_index = (m_mf_index + 1) % 5;
+	}
+}
+
+
+/*
+ * Add the power spectrum of s, zero-padded to FFT_SIZE, to acc.
+ */
+void fcch_detector::power_spectrum(const complex *s, const unsigned int s_len, float *acc) {
+
+	unsigned int i, len;
+
+	len = MIN(s_len, FFT_SIZE);
+	for(i = 0; i < len; i++) {
+		m_in[i][0] = s[i].real();
+		m_in[i][1] = s[i].imag();
+	}
+	for(i = len; i < FFT_SIZE; i++) {
+		m_in[i][0] = 0;
+		m_in[i][1] = 0;
+	}
+
+	fftw_execute(m_plan);
+
+	for(i = 0; i < FFT_SIZE; i++)
+		acc[i] += m_out[i][0] * m_out[i][0] + m_out[i][1] * m_out[i][1];
+}
+
+
+/*
+ * integrated:
+ * 	m_integrate predicted bursts have been summed at each alignment.  Take
+ * 	the alignment whose sum looks most like a tone, follow its timing and
+ * 	report its frequency.  Averaging doesn't raise the peak/mean of a tone,
+ * 	it narrows the spread of the noise, so the threshold comes down with
+ * 	the square root of the number of bursts.
+ */
+unsigned int fcch_detector::integrated(float *offset) {
+
+	const unsigned int step = m_fcch_burst_len / 16;
+	const float min_pm = 1.0 + (pm_threshold(m_fcch_burst_len -
+	   2 * step) - 1.0) / sqrtf(m_integrate);
+
+	unsigned int i, k, peak_i = 0, best_k = 0, best_i = 0;
+	float *a, peak, sum, pm, best_pm = 0.0, y0, y1, y2, d = 0.0;
+
+	for(k = 0; k < 2 * TRACK_STEPS + 1; k++) {
+		a = m_acc + k * FFT_SIZE;
+		peak = -1.0;
+		sum = 0.0;
+		for(i = 0; i < FFT_SIZE; i++) {
+			sum += a[i];
+			if(a[i] > peak) {
+				peak = a[i];
+				peak_i = i;
+			}
+		}
+		pm = peak / ((sum - peak) / (FFT_SIZE - 1) + 1e-20);
+		if(pm > best_pm) {
+			best_pm = pm;
+			best_k = k;
+			best_i = peak_i;
+		}
+	}
+
+	// parabolic interpolation between the bins around the peak
+	a = m_acc + best_k * FFT_SIZE;
+	y0 = a[(best_i + FFT_SIZE - 1) % FFT_SIZE];
+	y1 = a[best_i];
+	y2 = a[(best_i + 1) % FFT_SIZE];
+	if(y0 - 2 * y1 + y2 < 0.0)
+		d = 0.5 * (y0 - y2) / (y0 - 2 * y1 + y2);
+
+	memset(m_acc, 0, sizeof(float) * (2 * TRACK_STEPS + 1) * FFT_SIZE);
+	m_int_count = 0;
+
+	if(g_debug)
+		printf("debug: integrate: %d\t%f\t%f\n", (int)best_k - (int)TRACK_STEPS,
+		   best_pm, itof(best_i + d, m_sample_rate, FFT_SIZE));
+
+	if(best_pm <= min_pm) {
+		if(++m_misses > TRACK_MISS_MAX)
+			reset();
+		return 0;
+	}
+	m_misses = 0;
+	record(best_pm, min_pm, 0.0);
+	m_burst_pos += ((int)best_k - (int)TRACK_STEPS) * (int)step;
+	if(offset)
+		*offset = itof(best_i + d, m_sample_rate, FFT_SIZE);
+
+	return 1;
+}
+
+
+/*
+ * scan_fold:
+ * 	acquisition when integrating.  The short-time spectrum of every window
+ * 	is added to the bin for the window's position in the 51-frame
+ * 	multiframe, so the frequency bursts, which come back at the same
+ * 	places every multiframe, add up while traffic and noise average out.
+ * 	After m_integrate multiframes look for a run of bins with a steady
+ * 	tone, as scan_fft() does for single windows.
+ *
+ * 	The fold holds all five frequency bursts of the multiframe.  The one
+ * 	we found is the one whose neighbours at 10-frame spacing line up with
+ * 	the other four, which tells us where we are in the multiframe, and we
+ * 	lock on.  Nothing is reported until the first bursts are integrated.
+ */
+unsigned int fcch_detector::scan_fold(const complex *s, const unsigned int s_len, unsigned int *consumed) {
+
+	const double frame = 1250.0 * m_sample_rate / GSM_RATE;
+	const unsigned int MIN_FB_LEN = 100 * m_sample_rate / GSM_RATE;
+	const float min_pm = 1.0 + (win_threshold() - 1.0) / sqrtf(m_integrate);
+	const unsigned int margin = TRACK_STEPS * (m_fcch_burst_len / 16);
+
+	unsigned int w_count, w, b, batch, i, k, bin, peak_i, j, m, gap,
+	   run_start = 0, run_len = 0, best_start = 0, best_len = 0;
+	int d;
+	float peak, sum, *f, run_pm = 0.0, best_pm = 0.0;
+	double phase, score, best_score = -1.0;
+	const complex *x;
+	fftw_complex *in, *out;
+
+	if(consumed)
+		*consumed = s_len;
+
+	// fold every window onto its place in the multiframe
+	w_count = (s_len < m_stft_len)? 0 : (s_len - m_stft_len) / m_stft_hop + 1;
+	for(w = 0; w < w_count; w += batch) {
+		batch = MIN(STFT_BATCH, w_count - w);
+		for(b = 0; b < batch; b++) {
+			x = s + (w + b) * m_stft_hop;
+			in = m_stft_in + b * m_stft_len;
+			for(i = 0; i < m_stft_len; i++) {
+				in[i][0] = m_stft_win[i] * x[i].real();
+				in[i][1] = m_stft_win[i] * x[i].imag();
+			}
+		}
+
+		fftw_execute(m_stft_plan);
+
+		for(b = 0; b < batch; b++) {
+			bin = (unsigned int)(fmod(m_pos + (w + b) * m_stft_hop,
+			   m_mf_len) / m_stft_hop) % m_fold_bins;
+			out = m_stft_out + b * m_stft_len;
+			f = m_fold + bin * m_stft_len;
+			for(i = 0; i < m_stft_len; i++)
+				f[i] += out[i][0] * out[i][0] + out[i][1] * out[i][1];
+			m_fold_n[bin] += 1;
+		}
+	}
+	m_pos += s_len;
+	m_fold_samples += s_len;
+	if(m_fold_samples < m_integrate * m_mf_len)
+		return 0;
+
+	// peak bin and peak/mean of each place's spectrum
+	for(bin = 0; bin < m_fold_bins; bin++) {
+		f = m_fold + bin * m_stft_len;
+		peak = -1.0;
+		peak_i = 0;
+		sum = 0.0;
+		for(i = 0; i < m_stft_len; i++) {
+			sum += f[i];
+			if(f[i] > peak) {
+				peak = f[i];
+				peak_i = i;
+			}
+		}
+		for(d = -2; d <= 2; d++)
+			sum -= f[(peak_i + m_stft_len + d) % m_stft_len];
+		m_fold_peak[bin] = peak_i;
+		m_fold_pm[bin] = m_fold_n[bin]?
+		   peak / (fabsf(sum) / (m_stft_len - 5) + 1e-20) : 0.0;
+	}
+
+	// the strongest run of tone-like places with a steady peak
+	for(bin = 0; bin <= m_fold_bins; bin++) {
+		if((bin < m_fold_bins) && (m_fold_pm[bin] > min_pm)) {
+			if(run_len) {
+				d = (int)m_fold_peak[bin] - (int)m_fold_peak[bin - 1];
+				if((d >= -1) && (d <= 1)) {
+					run_len += 1;
+					run_pm += m_fold_pm[bin];
+					continue;
+				}
+			}
+		} else if(!run_len)
+			continue;
+
+		if((run_len * m_stft_hop >= MIN_FB_LEN) && (run_pm > best_pm)) {
+			best_pm = run_pm;
+			best_start = run_start;
+			best_len = run_len;
+		}
+
+		run_len = 0;
+		if((bin < m_fold_bins) && (m_fold_pm[bin] > min_pm)) {
+			run_start = bin;
+			run_len = 1;
+			run_pm = m_fold_pm[bin];
+		}
+	}
+
+	if(best_len) {
+		// which of the five bursts in the multiframe is it?
+		k = m_fold_peak[best_start + best_len / 2];
+		phase = (best_start + best_len / 2) * m_stft_hop;
+		for(j = 0; j < 5; j++) {
+			score = 0.0;
+			for(m = 0; m < 5; m++) {
+				bin = (unsigned int)(fmod(phase + (10.0 * m -
+				   10.0 * j) * frame + m_mf_len, m_mf_len) /
+				   m_stft_hop) % m_fold_bins;
+				if(m_fold_n[bin])
+					score += m_fold[bin * m_stft_len + k] /
+					   m_fold_n[bin];
+			}
+			if(score > best_score) {
+				best_score = score;
+				m_mf_index = j;
+			}
+		}
+
+		/*
+		 * Start from that burst in an earlier multiframe and step
+		 * forward until the next one is still ahead of us.
+		 */
+		phase = best_start * m_stft_hop + m_stft_len / 2;
+		m_burst_pos = phase + (floor((m_pos - phase) / m_mf_len) - 1) *
+		   m_mf_len;
+		for(;;) {
+			gap = (m_mf_index == 4)? 11 : 10;
+			if(m_burst_pos + gap * frame >= m_pos + margin)
+				break;
+			m_burst_pos += gap * frame;
+			m_mf_index = (m_mf_index + 1) % 5;
+		}
+		m_locked = true;
+		m_misses = 0;
+		m_int_count = 0;
+
+		if(g_debug)
+			printf("debug: fold: %u\t%f\t%d\n", best_len, best_pm / best_len,
+			   m_mf_index);
+	}
+
+	// start the next fold afresh
+	m_fold_samples = 0.0;
+	memset(m_fold, 0, sizeof(float) * m_fold_bins * m_stft_len);
+	memset(m_fold_n, 0, sizeof(unsigned int) * m_fold_bins);
+
+	return 0;
+}
+
+
+/*
+ * scan_capture:
+ * 	without the gate, run the selected engine over all of s.
+ *
+ * 	With the gate, look for regions where the symbol-to-symbol phase
+ * 	difference, arg(x[n] * conj(x[n - sps])), hardly varies.  A
+ * 	frequency burst advances by pi/2 every symbol while traffic jumps by
+ * 	+/- pi/2 at random.  Rather than take atan2 and a variance we use the
+ * 	circular equivalent, the normalized correlation
+ *
+ * 		|sum(x[n] * conj(x[n - sps]))|^2 /
+ * 		   (sum(|x[n]|^2) * sum(|x[n - sps]|^2))
+ *
+ * 	over a window of GATE_WINDOW symbols, which is near 1 for a constant
+ * 	phase step and near 0 for traffic and noise.  It costs a few flops per
+ * 	sample.  The engine then only runs on the regions that pass, padded
+ * 	so the adaptive filter and its error average have context.
+ */
+unsigned int fcch_detector::scan_capture(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed) {
+
+	const float sps = m_sample_rate / GSM_RATE;
+	const unsigned int MIN_FB_LEN = 100 * sps;
+	const unsigned int lag = (sps < 1.5)? 1 : (unsigned int)(sps + 0.5);
+	const unsigned int win = GATE_WINDOW * sps;
+	const unsigned int pad = GATE_PAD * m_fcch_burst_len;
+
+	unsigned int n, run_start = 0, run_len = 0, r_start = 0, r_end = 0,
+	   start, end;
+	double p0 = 0.0, p1 = 0.0, c;
+	std::complex<double> z = 0.0;
+
+	if(!m_gate)
+		return scan_engine(s, s_len, offset, consumed);
+
+	if(consumed)
+		*consumed = s_len;
+
+	for(n = lag; n <= s_len; n++) {
+
+		// slide the window forward one sample
+		if(n < s_len) {
+			z += std::complex<double>(s[n] * std::conj(s[n - lag]));
+			p0 += norm(s[n]);
+			p1 += norm(s[n - lag]);
+			if(n >= lag + win) {
+				z -= std::complex<double>(s[n - win] *
+				   std::conj(s[n - win - lag]));
+				p0 -= norm(s[n - win]);
+				p1 -= norm(s[n - win - lag]);
+			}
+			if(n + 1 < lag + win)
+				continue;
+
+			c = norm(z) / (p0 * p1 + 1e-20);
+			if(c > GATE_MIN) {
+				if(!run_len)
+					run_start = n + 1 - win;
+				run_len += 1;
+				continue;
+			}
+		}
+
+		// a low-variance run just ended, keep it if it is long enough
+		if(run_len && (run_len - 1 + win >= MIN_FB_LEN)) {
+			start = (run_start > pad)? run_start - pad : 0;
+			end = run_start + run_len - 1 + win + pad;
+			if(end > s_len)
+				end = s_len;
+
+			// merge with the previous region when they overlap
+			if((r_end > r_start) && (start <= r_end)) {
+				r_end = end;
+			} else {
+				if((r_end > r_start) && scan_engine(s + r_start,
+				   r_end - r_start, offset, 0)) {
+					m_found_at += r_start;
+					return 1;
+				}
+				r_start = start;
+				r_end = end;
+			}
+		}
+		run_len = 0;
+	}
+
+	if((r_end > r_start) && scan_engine(s + r_start, r_end - r_start,
+	   offset, 0)) {
+		m_found_at += r_start;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * scan_engine:
+ * 	run the selected engine over s.  ENGINE_COMPARE runs both engines on
+ * 	the same samples, keeps statistics for print_compare() and returns
+ * 	the lms result.
+ */
+unsigned int fcch_detector::scan_engine(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed) {
+
+	unsigned int r_lms, r_fft, r_ref, found_at;
+	float off_lms = 0, off_fft = 0;
+	double pos;
+	clock_t t0, t1, t2;
+
+	if(m_engine == ENGINE_FFT)
+		return scan_fft(s, s_len, offset, consumed);
+	if(m_engine != ENGINE_COMPARE)
+		return scan_lms(s, s_len, offset, consumed);
+
+	t0 = clock();
+	r_lms = scan_lms(s, s_len, &off_lms, consumed);
+	found_at = m_found_at;
+	t1 = clock();
+	r_fft = scan_fft(s, s_len, &off_fft, 0);
+	t2 = clock();
+	m_found_at = found_at;
+
+	/*
+	 * The front end must put bursts where the input rate filter does.
+	 * Each may pick a different burst of the capture, which is fine.
+	 */
+	if(m_ref) {
+		r_ref = m_ref->scan_lms(s, s_len, 0, 0);
+		pos = fabs((double)m_found_at - (double)m_ref->m_found_at);
+		if(r_lms && r_ref && (pos < m_fcch_burst_len)) {
+			m_cmp_ref += 1;
+			m_cmp_pos += pos;
+		}
+	}
+
+	m_cmp_count += 1;
+	m_cmp_lms_t += (double)(t1 - t0) / CLOCKS_PER_SEC;
+	m_cmp_fft_t += (double)(t2 - t1) / CLOCKS_PER_SEC;
+	if(r_lms)
+		m_cmp_lms += 1;
+	if(r_fft)
+		m_cmp_fft += 1;
+	if(r_lms && r_fft) {
+		m_cmp_both += 1;
+		m_cmp_diff += fabs(off_lms - off_fft);
+	}
+
+	if(g_debug) {
+		printf("debug: compare: lms %u %.1f\tfft %u %.1f\n", r_lms,
+		   off_lms, r_fft, off_fft);
+	}
+
+	if(r_lms && offset)
+		*offset = off_lms;
+
+	return r_lms;
+}
+
+
+void fcch_detector::print_compare() {
+
+	if(!m_cmp_count)
+		return;
+
+	printf("engine comparison over %u captures:\n", m_cmp_count);
+	printf("\tfound: lms %u, fft %u, both %u\n", m_cmp_lms, m_cmp_fft,
+	   m_cmp_both);
+	if(m_cmp_both)
+		printf("\tmean |lms - fft| offset: %.2fHz\n",
+		   m_cmp_diff / m_cmp_both);
+	if(m_cmp_ref)
+		printf("\tmean |decimated - input rate| burst position: "
+		   "%.1f samples over %u bursts\n", m_cmp_pos / m_cmp_ref, m_cmp_ref);
+	printf("\tcpu time: lms %.3fs, fft %.3fs\n", m_cmp_lms_t, m_cmp_fft_t);
+}
+
+
+/*
+ * scan_fft:
+ * 	1.  take overlapping windowed ffts across the buffer, STFT_BATCH
+ * 	    windows per fftw call
+ * 	2.  calculate the peak/mean of each window, leaving the bins next to
+ * 	    the peak out of the mean
+ * 	3.  find runs of windows with a high peak/mean in the same bin that
+ * 	    cover at least MIN_FB_LEN samples
+ * 	4.  for each such run, take fft and calculate peak/mean as the lms
+ * 	    engine does
+ */
+unsigned int fcch_detector::scan_fft(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed) {
+
+	const float sps = m_sample_rate / GSM_RATE;
+	const unsigned int MIN_FB_LEN = 100 * sps;
+	const float win_pm = win_threshold();
+
+	unsigned int w_count, w, b, batch, i, k, peak_i, run_start = 0,
+	   run_len = 0, l_count, y_offset = 0, y_len;
+	int d;
+	float p, peak, sum, loff = 0, pm = 0, pm_min = pm_threshold(m_fcch_burst_len);
+	const complex *x;
+	fftw_complex *in, *out;
+
+	if(consumed)
+		*consumed = s_len;
+	if(s_len < m_stft_len)
+		return 0;
+	w_count = (s_len - m_stft_len) / m_stft_hop + 1;
+
+	// peak bin and peak/mean of every window
+	for(w = 0; w < w_count; w += batch) {
+		batch = MIN(STFT_BATCH, w_count - w);
+		for(b = 0; b < batch; b++) {
+			x = s + (w + b) * m_stft_hop;
+			in = m_stft_in + b * m_stft_len;
+			for(i = 0; i < m_stft_len; i++) {
+				in[i][0] = m_stft_win[i] * x[i].real();
+				in[i][1] = m_stft_win[i] * x[i].imag();
+			}
+		}
+
+		fftw_execute(m_stft_plan);
+
+		for(b = 0; b < batch; b++) {
+			out = m_stft_out + b * m_stft_len;
+			peak = -1.0;
+			peak_i = 0;
+			sum = 0.0;
+			for(i = 0; i < m_stft_len; i++) {
+				p = out[i][0] * out[i][0] + out[i][1] * out[i][1];
+				sum += p;
+				if(p > peak) {
+					peak = p;
+					peak_i = i;
+				}
+			}
+
+			// the window spreads a tone over the neighbouring bins
+			for(d = -2; d <= 2; d++) {
+				k = (peak_i + m_stft_len + d) % m_stft_len;
+				sum -= out[k][0] * out[k][0] + out[k][1] * out[k][1];
+			}
+			m_stft_peak[w + b] = peak_i;
+			m_stft_pm[w + b] = peak / (fabsf(sum) / (m_stft_len - 5) + 1e-20);
+		}
+	}
+
+	// find runs of tone-like windows; window w_count ends the last run
+	for(w = 0; w <= w_count; w++) {
+		if(w < w_count && m_stft_pm[w] > win_pm) {
+			if(run_len) {
+				d = (int)m_stft_peak[w] - (int)m_stft_peak[w - 1];
+				if((d >= -1) && (d <= 1)) {
+					run_len += 1;
+					continue;
+				}
+			}
+		} else if(!run_len)
+			continue;
+
+		/*
+		 * See if the run that just ended is long enough.  A window
+		 * is flagged once the tone fills about half of it, so the
+		 * tone starts half a window into the first one.
+		 */
+		pm = 0;
+		l_count = run_len * m_stft_hop;
+		if(l_count >= MIN_FB_LEN) {
+			y_offset = run_start * m_stft_hop + m_stft_len / 2;
+			y_len = (l_count < m_fcch_burst_len)? l_count : m_fcch_burst_len;
+			loff = freq_detect(s + y_offset, y_len, &pm);
+			pm_min = pm_threshold(y_len);
+			if(g_debug)
+				printf("debug: fft: %.0f\t%f\t%f\t%f\n", (double)l_count / sps, pm, pm_min, loff);
+			if(pm > pm_min)
+				break;
+		}
+
+		// start a new run at this window if it qualifies
+		run_len = 0;
+		if((w < w_count) && (m_stft_pm[w] > win_pm)) {
+			run_start = w;
+			run_len = 1;
+		}
+	}
+
+	if(pm <= pm_min)
+		return 0;
+
+	record(pm, pm_min, 0.0);
+	m_found_at = y_offset;
+	if(offset)
+		*offset = loff;
+
+	return 1;
+}
+
+
+/*
+ * scan_lms:
+ * 	1.  calculate average error
+ * 	2.  find neighborhoods with low error that satisfy minimum length
+ * 	3.  for each such neighborhood, take fft and calculate peak/mean
+ * 	4.  if peak/mean > 50, then this is a valid finding.
+ */
+unsigned int fcch_detector::scan_lms(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed) {
+
+	const unsigned int delay = get_delay();
+
+	unsigned int len = 0, t, e_count, x_len, blk, b, end, e_written = 0,
+	   n_e = 0, r;
+	float e, *a;
+	double sum = 0.0;
+	const complex *x;
+
+	x = front_end(s, s_len, &x_len);
+
+	// blocks of input samples too quiet to bother filtering
+	blk = energy_gate(s, s_len);
+
+	// calculate the error for each sample
+	while(len < x_len) {
+		b = len * m_decimation / (blk? blk : 1);
+		if(blk && (m_block_e[b] < m_block_limit)) {
+			/*
+			 * Skip to the end of the block.  Mark the skipped
+			 * errors high so the error index stays aligned with
+			 * the samples, and refill the filter history with the
+			 * end of the block so the next block starts as if
+			 * nothing had been skipped.
+			 */
+			end = ((b + 1) * blk + m_decimation - 1) / m_decimation;
+			if(end > x_len)
+				end = x_len;
+			for(; e_written + delay < end; e_written++)
+				m_e_cb->write(&SKIPPED_ERROR, 1);
+			m_x_cb->flush();
+			m_x_power_valid = false;
+			if(end > delay)
+				m_x_cb->write(x + end - delay, delay);
+			else
+				m_x_cb->write(x, end);
+			len = end;
+			continue;
+		}
+		t = m_x_cb->write(x + len, 1);
+		len += t;
+		if(!next_norm_error(&e)) {
+			m_e_cb->write(&e, 1);
+			e_written += 1;
+			sum += e;
+			n_e += 1;
+		}
+	}
+	if(consumed)
+		*consumed = s_len;
+
+	// calculate average error over the samples actually filtered
+	a = (float *)m_e_cb->peek(&e_count);
+	if(!n_e) {
+		m_e_cb->flush();
+		m_x_cb->flush();
+		m_y_cb->flush();
+		m_x_power_valid = false;
+		return 0;
+	}
+	r = find_burst(s, 0, s_len, a, e_count, sum / (double)n_e, offset);
+
+	// empty buffers for next call
+	m_e_cb->flush();
+	m_x_cb->flush();
+	m_y_cb->flush();
+	m_x_power_valid = false;
+
+	return r;
+}
+
+
+/*
+ * The adaptive filter runs on either the input or the front end output.
+ */
+const complex *fcch_detector::front_end(const complex *s, const unsigned int s_len, unsigned int *x_len) {
+
+	if(m_decimation > 1) {
+		*x_len = mix_decimate(s, s_len);
+		return m_d;
+	}
+	*x_len = s_len;
+	return s;
+}
+
+
+/*
+ * scan_errors:
+ * 	scan_lms() for a caller that has already run the adaptive filter over
+ * 	s, such as fcch_batch.  e holds one error ratio for each sample of the
+ * 	front end output after the first get_delay().
+ */
+unsigned int fcch_detector::scan_errors(const complex *s, const unsigned int s_len, const float *e, const unsigned int e_len, float *offset) {
+
+	unsigned int i;
+	double sum = 0.0;
+
+	// the constant false alarm rate sums are sized like the error buffer
+	if((!e_len) || (e_len > m_e_cb->buf_len()))
+		return 0;
+	for(i = 0; i < e_len; i++)
+		sum += e[i];
+
+	return find_burst(s, 0, s_len, e, e_len, sum / (double)e_len, offset);
+}
+
+
+// bits needed to hold x
+static unsigned int bit_len(uint64_t x) {
+
+	unsigned int n = 0;
+
+	while(x) {
+		x >>= 1;
+		n += 1;
+	}
+
+	return n;
+}
+
+
+/*
+ * scan_q15:
+ * 	scan_lms() for complex16 samples.  The adaptive filter and its error
+ * 	average run in fixed point with the same recursion as
+ * 	next_norm_error().  G keeps 15 bits, as rounding it to a power of two
+ * 	cost detections.  We go back to floating point for the error ratios
+ * 	and the spectrum of each candidate burst.
+ *
+ * 	Only the plain adaptive filter over a whole capture is done this way.
+ */
+unsigned int fcch_detector::scan_q15(const complex16 *s, const unsigned int s_len, float *offset, unsigned int *consumed) {
+
+	const unsigned int delay = get_delay();
+
+	unsigned int t, e_len, space;
+	int64_t P, E, e2, g;
+	float *a;
+	double sum = 0.0;
+	complex16 e;
+
+	if(consumed)
+		*consumed = s_len;
+	if((m_decimation > 1) || (s_len <= delay))
+		return 0;
+
+	// the error buffer is empty between scans
+	a = (float *)m_e_cb->poke(&space);
+	e_len = MIN(s_len - delay, space);
+	P = norm2_q15(s, m_w_len);
+	for(t = 0; t < e_len; t++) {
+
+		// update G = m_g16 * 2^-m_shift; the window power P is exact
+		if(t)
+			P += norm2_q15(s + t + m_w_len - 1, 1) - norm2_q15(s + t - 1, 1);
+		E = P;
+		if(E < 1)
+			E = 1;
+		if(((E * m_g16) >> m_shift) >= 2) {
+			m_shift = bit_len(E) + 14;
+			g = ((int64_t)1 << m_shift) / E;
+			m_g16 = (g > 32767)? 32767 : g;
+		}
+
+		e = lms_step_q15(m_w16, s + t, m_w_len, m_g16, m_shift,
+		   s[t + delay]);
+
+		// update error average power, p is 2^-m_p_shift; e is halved
+		e2 = 4 * ((int64_t)e.i * e.i + (int64_t)e.q * e.q);
+		m_e16 += (e2 - m_e16) >> m_p_shift;
+
+		a[t] = (float)m_e16 / ((float)E / m_w_len);
+		sum += a[t];
+	}
+
+	return find_burst(0, s, s_len, a, e_len, sum / (double)e_len, offset);
+}
+
+
+/*
+ * scan_soa:
+ * 	scan_lms() over the I and Q arrays of b, which hold the samples of s.
+ * 	The recursion is that of next_norm_error(); only the plain adaptive
+ * 	filter over a whole capture at the input rate is done this way and
+ * 	everything else goes through scan().  The candidate bursts are
+ * 	checked on s.
+ */
+unsigned int fcch_detector::scan_soa(const complex *s, soa_buffer *b, const unsigned int s_len, float *offset, unsigned int *consumed) {
+
+	const unsigned int delay = get_delay();
+	const unsigned int n = m_w_len - 1;
+
+	unsigned int t, k, e_len, space;
+	float E, e_i, e_q, *a;
+	const float *x_i, *x_q;
+	double sum = 0.0;
+	power_sum p;
+
+	if((!b) || (b->len() < s_len) || m_continuous || m_gate ||
+	   (m_engine != ENGINE_LMS) || (m_decimation > 1) || m_noise_floor)
+		return scan(s, s_len, offset, consumed);
+
+	if(consumed)
+		*consumed = s_len;
+	if(s_len <= delay)
+		return 0;
+	x_i = b->i();
+	x_q = b->q();
+
+	// the error buffer is empty between scans
+	a = (float *)m_e_cb->poke(&space);
+	e_len = MIN(s_len - delay, space);
+	for(k = 0; k < m_w_len; k++)
+		p.add(x_i[k] * x_i[k] + x_q[k] * x_q[k]);
+	for(t = 0; t < e_len; t++) {
+
+		// update G, with the window power slid along one sample
+		if(t) {
+			p.add(-(x_i[t - 1] * x_i[t - 1] + x_q[t - 1] * x_q[t - 1]));
+			p.add(x_i[t + n] * x_i[t + n] + x_q[t + n] * x_q[t + n]);
+		}
+		E = p.value();
+		if(m_G >= 2.0 / E)
+			m_G = 1.0 / E;
+
+		lms_step_soa(m_w_i, m_w_q, x_i + t, x_q + t, m_w_len, m_G,
+		   x_i[t + delay], x_q[t + delay], &e_i, &e_q);
+
+		// update error average power
+		E /= m_w_len;
+		m_e = (1.0 - m_p) * m_e + m_p * (e_i * e_i + e_q * e_q);
+
+		a[t] = m_e / E;
+		sum += a[t];
+	}
+
+	return find_burst(s, 0, s_len, a, e_len, sum / (double)e_len, offset);
+}
+
+
+/*
+ * Buffers and plan for FB_BATCH candidate ffts at once.  The rows are laid
+ * out like m_in so that a partial batch can go through m_plan one row at a
+ * time.
+ */
+void fcch_detector::fb_init() {
+
+	int n = FFT_SIZE;
+
+	if(m_fb_plan)
+		return;
+
+	m_fb_in = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * FFT_SIZE *
+	   FB_BATCH);
+	m_fb_out = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * FFT_SIZE *
+	   FB_BATCH);
+	if((!m_fb_in) || (!m_fb_out))
+		throw std::runtime_error("fcch_detector: fftw_malloc failed!");
+
+	pthread_mutex_lock(&fftw_mutex);
+	m_fb_plan = fftw_plan_many_dft(1, &n, FB_BATCH, m_fb_in, 0, 1, n,
+	   m_fb_out, 0, 1, n, FFTW_FORWARD, FFTW_MEASURE);
+	pthread_mutex_unlock(&fftw_mutex);
+	if(!m_fb_plan)
+		throw std::runtime_error("fcch_detector: fftw plan failed!");
+}
+
+
+/*
+ * Transform the waiting candidates, a full batch in one fftw call, and keep
+ * the one with the highest peak/mean of those over their threshold in best.
+ */
+void fcch_detector::fb_flush(const complex *s, const complex16 *s16, fb_candidate *best) {
+
+	const float sps = m_sample_rate / GSM_RATE;
+
+	unsigned int c;
+	fb_candidate *f;
+
+	for(c = 0; c < m_fb_count; c++) {
+		f = m_fb + c;
+		fft_load(m_fb_in + c * FFT_SIZE, s? s + f->offset : 0,
+		   s16? s16 + f->offset : 0, f->len);
+	}
+	// with the zoom on, zoom_peak() does each candidate's transform
+	if(!m_zoom_m) {
+		if(m_fb_count == FB_BATCH)
+			fftw_execute(m_fb_plan);
+		else {
+			for(c = 0; c < m_fb_count; c++)
+				fftw_execute_dft(m_plan, m_fb_in + c * FFT_SIZE,
+				   m_fb_out + c * FFT_SIZE);
+		}
+	}
+
+	for(c = 0; c < m_fb_count; c++) {
+		f = m_fb + c;
+		if(m_zoom_m)
+			f->freq = zoom_peak(m_fb_in + c * FFT_SIZE, f->len, &f->pm);
+		else
+			f->freq = spectrum_peak(m_fb_out + c * FFT_SIZE, &f->pm);
+		f->pm_min = pm_threshold(f->len);
+		if(g_debug)
+			printf("debug: %.0f\t%f\t%f\t%f\n", (double)f->l_count / sps, f->pm, f->pm_min, f->freq);
+		if((f->pm > f->pm_min) && (f->pm > best->pm))
+			*best = *f;
+	}
+	m_fb_count = 0;
+}
+
+
+/*
+ * find_burst:
+ * 	given the errors a of the adaptive filter over s and their average,
+ * 	find the runs of low error long enough for a frequency burst, and of
+ * 	those whose spectrum has a clear peak, the one with the clearest.
+ * 	The fixed point path passes its samples as s16 instead.
+ */
+unsigned int fcch_detector::find_burst(const complex *s, const complex16 *s16, const unsigned int s_len, const float *a, const unsigned int e_count, double avg, float *offset) {
+
+	const float sps = m_sample_rate / GSM_RATE;
+	const unsigned int MIN_FB_LEN = 100 * sps;
+
+	// the same length in adaptive filter samples
+	const unsigned int min_run = (MIN_FB_LEN + m_decimation - 1) /
+	   m_decimation;
+
+	unsigned int i, run, l_count, y_offset;
+	double limit, i_limit = 0.0;
+	fb_candidate *f, best;
+
+	m_fb_count = 0;
+	best.pm = 0;
+
+	// in continuous mode the average carries over from earlier captures
+	if(m_continuous) {
+		m_e_avg = (m_e_avg > 0.0)? 0.75 * m_e_avg + 0.25 * avg : avg;
+		avg = m_e_avg;
+	}
+	limit = 0.7 * avg;
+
+	if(g_debug) {
+		printf("debug: error limit: %.1lf\n", limit);
+	}
+
+	// with a target false alarm rate the limit follows the local errors
+	if(m_pfa > 0.0)
+		local_error_init(a, e_count);
+
+	// find neighborhoods where the error is smaller than the limit
+	low_to_high_init();
+	for(i = 0; i < e_count; i++) {
+		if(m_pfa > 0.0) {
+			i_limit = local_error(i, e_count, limit);
+			run = low_to_high(m_e_smooth[i], i_limit);
+		} else {
+			i_limit = limit;
+			run = low_to_high(a[i], limit);
+		}
+
+		// queue the neighborhood to see if p/m indicates a pure tone
+		if(run >= min_run) {
+			/*
+			 * Error i is for the filter window starting at sample
+			 * i, so the run started at sample i - run.  Front end
+			 * sample k is centred on input sample k * decimation
+			 * plus the group delay of the low-pass, and the
+			 * low-pass spreads the start of the tone over another
+			 * group delay before that, which is where the error
+			 * already starts to drop.
+			 */
+			l_count = run * m_decimation;
+			y_offset = (i - run) * m_decimation;
+			if(m_decimation > 1) {
+				y_offset += m_lpf_len - 1;
+				if(y_offset + l_count > s_len)
+					continue;
+			}
+			f = m_fb + m_fb_count++;
+			f->offset = y_offset;
+			f->len = (l_count < m_fcch_burst_len)? l_count : m_fcch_burst_len;
+			f->l_count = l_count;
+			f->limit = i_limit;
+			if(m_fb_count == FB_BATCH)
+				fb_flush(s, s16, &best);
+		}
+	}
+	fb_flush(s, s16, &best);
+	if(best.pm <= 0)
+		return 0;
+
+	record(best.pm, best.pm_min, best.limit);
+	m_found_at = best.offset;
+	if(offset)
+		*offset = best.freq;
+
+	if(g_debug) {
+		printf("debug: fcch_detector finished -----------------------------\n");
+	}
+
+	return 1;
+}
+
+
+unsigned int fcch_detector::update(const complex *s, const unsigned int s_len) {
+
+	return m_x_cb->write(s, s_len);
+}
+
+
+unsigned int fcch_detector::get_delay() {
+
+	return m_w_len - 1 + m_D;
+}
+
+
+unsigned int fcch_detector::filter_len() {
+
+	return m_w_len;
+}
+
+
+/*
+ * Set the noise floor, in power per sample, for the energy gate.  0 turns
+ * the gate off and NOISE_AUTO uses the quietest block of each capture.
+ */
+void fcch_detector::set_noise_floor(float noise) {
+
+	m_noise_floor = noise;
+	if(noise && !m_block_e) {
+		m_block_e = new float[m_e_cb->buf_len() /
+		   (unsigned int)(ENERGY_BLOCK * m_sample_rate / GSM_RATE) + 2];
+		m_block_p = new power_prefix(m_e_cb->buf_len());
+	}
+}
+
+
+/*
+ * energy_gate:
+ * 	calculate the power in each block of ENERGY_BLOCK symbols, the same
+ * 	way c0_detect measures channel power.  Blocks that don't rise
+ * 	ENERGY_GATE_SNR above the noise floor are below m_block_limit and
+ * 	scan_lms() won't run the adaptive filter over them.
+ *
+ * 	Returns the block length in input samples, or 0 if no block is to be
+ * 	skipped.
+ */
+unsigned int fcch_detector::energy_gate(const complex *s, const unsigned int s_len) {
+
+	const unsigned int blk = ENERGY_BLOCK * m_sample_rate / GSM_RATE;
+
+	unsigned int b, b_count, len, skipped = 0;
+	float e_min = 0, e_max = 0;
+
+	if((!m_noise_floor) || (!blk))
+		return 0;
+
+	m_block_p->load(s, s_len);
+	b_count = (m_block_p->len() + blk - 1) / blk;
+	for(b = 0; b < b_count; b++) {
+		len = MIN(blk, m_block_p->len() - b * blk);
+		m_block_e[b] = m_block_p->window(b * blk, len) / len;
+		if((!b) || (m_block_e[b] < e_min))
+			e_min = m_block_e[b];
+		if((!b) || (m_block_e[b] > e_max))
+			e_max = m_block_e[b];
+	}
+
+	if(m_noise_floor > 0) {
+		m_block_limit = ENERGY_GATE_SNR * m_noise_floor;
+	} else {
+		// without quiet blocks there's no noise floor to measure
+		if(e_max < ENERGY_GATE_SNR * e_min)
+			return 0;
+		m_block_limit = ENERGY_GATE_SNR * e_min;
+	}
+
+	for(b = 0; b < b_count; b++)
+		if(m_block_e[b] < m_block_limit)
+			skipped += 1;
+
+	if(g_debug)
+		printf("debug: energy gate: skipping %u of %u blocks\n", skipped, b_count);
+
+	return skipped? blk : 0;
+}
+
+
+/*
+ * First y value comes out at sample x[n + m_D] = x[w_len - 1 + m_D].
+ *
+ * 	y[0] = X(x[0], ..., x[w_len - 1 + m_D])
+ *
+ * So y and e are delayed by w_len - 1 + m_D.
+ */
+int fcch_detector::next_norm_error(float *error) {
+
+	unsigned int n, max, i;
+	float E;
+	complex *x, e;
+
+	// n is "current" sample
+	n = m_w_len - 1;
+
+	// ensure there are enough samples in the buffer
+	x = (complex *)m_x_cb->peek(&max);
+	if(n + m_D >= max)
+		return n + m_D - max + 1;
+
+	// update G, with the window power carried over from the last sample
+	if(!m_x_power_valid) {
+		m_x_power.reset();
+		for(i = 0; i < m_w_len; i++)
+			m_x_power.add(norm(x[i]));
+		m_x_power_valid = true;
+	}
+	E = m_x_power.value();
+	if(m_G >= 2.0 / E)
+		m_G = 1.0 / E;
+
+	// m_y_cb->write(&y, 1);
+	m_y_cb->write(x + n + m_D, 1); // XXX save filtered value?
+
+	// filter, take the error from the desired signal and update the taps
+	e = lms_step(m_w, x, m_w_len, m_G, x[n + m_D]);
+
+	// update error average power
+	E /= m_w_len;
+	m_e = (1.0 - m_p) * m_e + m_p * norm(e);
+
+	// return error ratio
+	if(error)
+		*error = m_e / E;
+
+	// remove the processed sample from the buffer and slide the window
+	if(m_w_len < max) {
+		m_x_power.add(-norm(x[0]));
+		m_x_power.add(norm(x[m_w_len]));
+	} else
+		m_x_power_valid = false;
 	m_x_cb->purge(1);
 
 	return 0;
@@ -523,5 +2648,6 @@ unsigned int fcch_detector::x_buf_len() {
 
 unsigned int fcch_detector::x_purge(unsigned int len) {
 
+	m_x_power_valid = false;
 	return m_x_cb->purge(len);
 }
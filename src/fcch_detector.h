@@ -44,16 +44,35 @@
 #include <fftw3.h>
 
 #include "circular_buffer.h"
+#include "power_sum.h"
+#include "soa_buffer.h"
 #include "usrp_complex.h"
 
 class fcch_detector {
 
+	// runs the adaptive filters of several detectors at once
+	friend class fcch_batch;
+
 public:
-	fcch_detector(const float sample_rate, const unsigned int D = 8, const float p = 1.0 / 32.0, const float G = 1.0 / 12.5);
+	// set_noise_floor(): estimate the noise floor from each capture
+	static const int NOISE_AUTO = -1;
+
+	enum {
+		ENGINE_LMS	= 0,	// adaptive filter error ratio
+		ENGINE_FFT	= 1,	// sliding short-time fft peak/mean
+		ENGINE_COMPARE	= 2	// run both, report lms
+	};
+
+	fcch_detector(const float sample_rate, const unsigned int scan_len = 0, const unsigned int D = 8, const float p = 1.0 / 32.0, const float G = 1.0 / 12.5);
 	~fcch_detector();
 	unsigned int scan(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed);
+	unsigned int scan_q15(const complex16 *s, const unsigned int s_len, float *offset, unsigned int *consumed);
+	unsigned int scan_soa(const complex *s, soa_buffer *b, const unsigned int s_len, float *offset, unsigned int *consumed);
 	float freq_detect(const complex *s, const unsigned int s_len, float *pm);
+	float freq_detect(const complex16 *s, const unsigned int s_len, float *pm);
 	unsigned int update(const complex *s, unsigned int s_len);
+	const complex *front_end(const complex *s, const unsigned int s_len, unsigned int *x_len);
+	unsigned int scan_errors(const complex *s, const unsigned int s_len, const float *e, const unsigned int e_len, float *offset);
 	int next_norm_error(float *error);
 	complex *dump_x(unsigned int *);
 	complex *dump_y(unsigned int *);
@@ -63,26 +82,206 @@ public:
 	unsigned int x_buf_len();
 	unsigned int y_buf_len();
 	unsigned int x_purge(unsigned int);
+	int set_decimation(unsigned int decimation);
+	unsigned int decimation() { return m_decimation; };
+	unsigned int mix_decimate(const complex *s, const unsigned int s_len);
+	int set_engine(int engine);
+	void set_gate(bool enable);
+	int set_zoom(float span);
+	void set_noise_floor(float noise);
+	void set_continuous(bool enable);
+	int set_integrate(unsigned int n);
+	int set_pfa(double pfa);
+	void thresholds(float *pm, float *pm_min, float *limit);
+	void reset();
+	int next_burst(double *pos);
+	int next_window(unsigned int *skip, unsigned int *len);
+	void skip(unsigned int len);
+	bool locked() { return m_locked; };
+	unsigned int found_at() { return m_found_at; };
+	void align(double burst_pos);
+	void print_compare();
 
 private:
 #define GSM_RATE (1625000.0 / 6.0)
 #define FFT_SIZE 1024
 
+	/*
+	 * Default length of the error buffer when the caller doesn't tell us
+	 * how many samples it will pass to scan().
+	 */
+	static const unsigned int	E_CB_LEN	= 1015808;
+
+	// windows per fftw_plan_many_dft batch in the fft engine
+	static const unsigned int	STFT_BATCH	= 64;
+
+	// find_burst() candidates per fftw_plan_many_dft batch
+	static const unsigned int	FB_BATCH	= 8;
+
+	// a low-error neighborhood, and once transformed, its tone
+	struct fb_candidate {
+		unsigned int	offset,
+				len,
+				l_count;
+		double		limit;
+		float		pm,
+				pm_min,
+				freq;
+	};
+
+	void stft_init();
+	void power_spectrum(const complex *s, const unsigned int s_len, float *acc);
+	unsigned int scan_fold(const complex *s, const unsigned int s_len, unsigned int *consumed);
+	unsigned int integrated(float *offset);
+	float pm_threshold(const unsigned int len);
+	float win_threshold();
+	void record(float pm, float pm_min, float limit);
+	unsigned int find_burst(const complex *s, const complex16 *s16, const unsigned int s_len, const float *a, const unsigned int e_count, double avg, float *offset);
+	void fft_load(fftw_complex *in, const complex *s, const complex16 *s16, const unsigned int s_len);
+	float spectrum_peak(const fftw_complex *out, float *pm);
+	float transform_peak(const unsigned int len, float *pm);
+	void filter_init(unsigned int filter_delay, unsigned int D, float p);
+	void ref_init();
+	void zoom_free();
+	float zoom_peak(const fftw_complex *x, const unsigned int len, float *pm);
+	void fb_init();
+	void fb_flush(const complex *s, const complex16 *s16, fb_candidate *best);
+	void low_to_high_init();
+	unsigned int low_to_high(float e, float a);
+	void local_error_init(const float *a, const unsigned int a_len);
+	double local_error(const unsigned int i, const unsigned int a_len, const double limit);
+	unsigned int scan_stream(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed);
+	unsigned int scan_capture(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed);
+	unsigned int energy_gate(const complex *s, const unsigned int s_len);
+	unsigned int scan_engine(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed);
+	unsigned int scan_lms(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed);
+	unsigned int scan_fft(const complex *s, const unsigned int s_len, float *offset, unsigned int *consumed);
+
 	unsigned int	m_w_len,
 			m_D,
 			m_check_G,
 			m_filter_delay,
 			m_lpf_len,
+			m_decimation,
+			m_d_len,
 			m_fcch_burst_len;
 	float		m_sample_rate,
 			m_p,
 			m_G,
 			m_e;
-	complex 	*m_w;
+	complex 	*m_w,
+			*m_lpf,
+			*m_d;
+
+	// D and p at the input rate, set_decimation() scales them
+	unsigned int	m_full_D;
+	float		m_full_p;
+
+	// scan_q15() filter state, G is m_g16 * 2^-m_shift
+	complex16	*m_w16;
+	int16_t		m_g16;
+	unsigned int	m_shift,
+			m_p_shift;
+	int64_t		m_e16;
+	// scan_soa() taps, split like the samples
+	float		*m_w_i,
+			*m_w_q;
+	// power of the filter window, slid along by next_norm_error()
+	power_sum	m_x_power;
+	bool		m_x_power_valid;
+
 	circular_buffer *m_x_cb,
 			*m_y_cb,
 			*m_e_cb;
 
 	fftw_complex	*m_in, *m_out;
 	fftw_plan	m_plan;
+
+	// spectrum_peak() works on a copy of the fft output
+	complex		*m_fft;
+
+	// chirp-z zoom over GSM_RATE / 4 +/- m_zoom_span
+	float		m_zoom_span;
+	unsigned int	m_zoom_n,
+			m_zoom_m,
+			m_zoom_l;
+	double		m_zoom_f0,
+			m_zoom_df;
+	fftw_complex	*m_zoom_a, *m_zoom_b,
+			*m_zoom_in, *m_zoom_out;
+	fftw_plan	m_zoom_fwd, m_zoom_inv;
+
+	// find_burst() candidates waiting for the batched fft
+	fb_candidate	m_fb[FB_BATCH];
+	unsigned int	m_fb_count;
+	fftw_complex	*m_fb_in, *m_fb_out;
+	fftw_plan	m_fb_plan;
+
+	int		m_engine;
+	bool		m_gate;
+	float		m_noise_floor,
+			m_block_limit,
+			*m_block_e;
+	power_prefix	*m_block_p;
+
+	// low_to_high() run state
+	unsigned int	m_lh_count,
+			m_lh_state;
+
+	// continuous mode and multiframe tracking
+	bool		m_continuous,
+			m_locked;
+	int		m_mf_index;
+	unsigned int	m_found_at,
+			m_run10,
+			m_cand,
+			m_misses;
+	double		m_pos,
+			m_s_pos,
+			m_burst_pos,
+			m_e_avg;
+	unsigned int	m_stft_len,
+			m_stft_hop;
+	float		*m_stft_win;
+	fftw_complex	*m_stft_in, *m_stft_out;
+	fftw_plan	m_stft_plan;
+	unsigned int	*m_stft_peak;
+	float		*m_stft_pm;
+
+	// multi-burst integration
+	unsigned int	m_integrate,
+			m_int_count,
+			m_fold_bins,
+			*m_fold_n,
+			*m_fold_peak;
+	double		m_mf_len,
+			m_fold_samples;
+	float		*m_acc,
+			*m_fold,
+			*m_fold_pm;
+
+	// constant false alarm rate thresholds and those of the last detection
+	double		m_pfa,
+			m_cfar_z,
+			*m_e_sum,
+			*m_e_sq;
+	unsigned int	*m_e_n;
+	float		*m_e_smooth;
+	float		m_det_pm,
+			m_det_pm_min,
+			m_det_limit;
+
+	// ENGINE_COMPARE statistics
+	unsigned int	m_cmp_count,
+			m_cmp_lms,
+			m_cmp_fft,
+			m_cmp_both;
+	double		m_cmp_diff,
+			m_cmp_lms_t,
+			m_cmp_fft_t;
+
+	// and with decimation, the same filter at the input rate
+	fcch_detector	*m_ref;
+	unsigned int	m_cmp_ref;
+	double		m_cmp_pos;
 };
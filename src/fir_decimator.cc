@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#include <stdexcept>
+#include "fir_decimator.h"
+
+
+/*
+ * Blackman windowed sinc with its cutoff at the given fraction of the output
+ * rate.  With the default 64 taps for each output sample the transition band
+ * is about 0.08 of the output rate wide, so the output is flat to 0.40 and
+ * a channel 200 kHz away, which starts at 0.37 of the GSM rate, is down
+ * before it can fold in.
+ */
+fir_decimator::fir_decimator(const unsigned int decimation,
+   const unsigned int max_len, const unsigned int taps_per_phase,
+   const float cutoff) {
+
+	unsigned int i;
+	double x, w, sum;
+
+	if(!decimation)
+		throw std::runtime_error("fir_decimator: decimation is 0");
+
+	m_decimation = decimation;
+	m_max_len = max_len;
+	m_taps_len = decimation * taps_per_phase;
+	m_phase = 0;
+
+	m_taps = new float[m_taps_len];
+	m_i = new float[m_taps_len - 1 + max_len];
+	m_q = new float[m_taps_len - 1 + max_len];
+
+	sum = 0.0;
+	for(i = 0; i < m_taps_len; i++) {
+		x = i - (m_taps_len - 1) / 2.0;
+		w = 0.42 - 0.5 * cos(2 * M_PI * i / (m_taps_len - 1)) +
+		   0.08 * cos(4 * M_PI * i / (m_taps_len - 1));
+		x *= 2 * cutoff / decimation;
+		m_taps[i] = w * ((x == 0.0)? 1.0 : sin(M_PI * x) / (M_PI * x));
+		sum += m_taps[i];
+	}
+	for(i = 0; i < m_taps_len; i++)
+		m_taps[i] /= sum;
+
+	reset();
+}
+
+
+fir_decimator::~fir_decimator() {
+
+	delete[] m_taps;
+	delete[] m_i;
+	delete[] m_q;
+}
+
+
+void fir_decimator::reset() {
+
+	memset(m_i, 0, (m_taps_len - 1) * sizeof(float));
+	memset(m_q, 0, (m_taps_len - 1) * sizeof(float));
+	m_phase = 0;
+}
+
+
+/*
+ * Output samples the next s_len input samples will produce.
+ */
+unsigned int fir_decimator::out_len(const unsigned int s_len) {
+
+	return (s_len > m_phase)? (s_len - m_phase + m_decimation - 1) / m_decimation : 0;
+}
+
+
+/*
+ * Append s to the history.  The first m_taps_len - 1 entries of m_i and m_q
+ * are the last inputs of the previous call.
+ */
+unsigned int fir_decimator::push(const complex *s, const unsigned int s_len) {
+
+	unsigned int i, len;
+	float *in = m_i + m_taps_len - 1, *qn = m_q + m_taps_len - 1;
+
+	len = (s_len < m_max_len)? s_len : m_max_len;
+	for(i = 0; i < len; i++) {
+		in[i] = s[i].real();
+		qn[i] = s[i].imag();
+	}
+
+	return len;
+}
+
+
+/*
+ * Keep the last m_taps_len - 1 inputs for the next call and work out where
+ * in it the next output falls.
+ */
+void fir_decimator::shift(const unsigned int s_len) {
+
+	unsigned int h = m_taps_len - 1;
+
+	memmove(m_i, m_i + s_len, h * sizeof(float));
+	memmove(m_q, m_q + s_len, h * sizeof(float));
+
+	m_phase = m_phase + out_len(s_len) * m_decimation - s_len;
+}
+
+
+unsigned int fir_decimator::filter(const complex *s, const unsigned int s_len,
+   complex *out) {
+
+	unsigned int len, t, j, o;
+	float i0, i1, i2, i3, q0, q1, q2, q3;
+	const float *x, *y, *h = m_taps;
+
+	len = push(s, s_len);
+
+	/*
+	 * Four partial sums per component keep the loop free of a dependency
+	 * chain so the compiler can vectorize it.
+	 */
+	o = 0;
+	for(t = m_phase; t < len; t += m_decimation) {
+		x = m_i + t;
+		y = m_q + t;
+		i0 = i1 = i2 = i3 = q0 = q1 = q2 = q3 = 0.0;
+		for(j = 0; j + 3 < m_taps_len; j += 4) {
+			i0 += h[j] * x[j];
+			i1 += h[j + 1] * x[j + 1];
+			i2 += h[j + 2] * x[j + 2];
+			i3 += h[j + 3] * x[j + 3];
+			q0 += h[j] * y[j];
+			q1 += h[j + 1] * y[j + 1];
+			q2 += h[j + 2] * y[j + 2];
+			q3 += h[j + 3] * y[j + 3];
+		}
+		for(; j < m_taps_len; j++) {
+			i0 += h[j] * x[j];
+			q0 += h[j] * y[j];
+		}
+		out[o++] = complex((i0 + i1) + (i2 + i3), (q0 + q1) + (q2 + q3));
+	}
+
+	shift(len);
+
+	return o;
+}
+
+
+/*
+ * Drop the outputs s would produce without computing them.  Returns how
+ * many there would have been.
+ */
+unsigned int fir_decimator::skip(const complex *s, const unsigned int s_len) {
+
+	unsigned int len, n;
+
+	len = push(s, s_len);
+	n = out_len(len);
+	shift(len);
+
+	return n;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Low-pass filter and decimate a complex stream.  Only the samples we keep
+ * are computed, each as a dot product of the taps with the last taps_len
+ * inputs.  The inputs are kept as separate I and Q arrays so those dot
+ * products run over contiguous floats.
+ */
+
+#pragma once
+
+#include "usrp_complex.h"
+
+class fir_decimator {
+
+public:
+	fir_decimator(const unsigned int decimation, const unsigned int max_len, const unsigned int taps_per_phase = 64, const float cutoff = 0.44);
+	~fir_decimator();
+	unsigned int filter(const complex *s, const unsigned int s_len, complex *out);
+	unsigned int skip(const complex *s, const unsigned int s_len);
+	unsigned int out_len(const unsigned int s_len);
+	void reset();
+	unsigned int decimation() { return m_decimation; };
+
+private:
+	unsigned int push(const complex *s, const unsigned int s_len);
+	void shift(const unsigned int s_len);
+
+	unsigned int	m_decimation,
+			m_max_len,
+			m_taps_len,
+			m_phase;
+	float		*m_taps,
+			*m_i,
+			*m_q;
+};
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+
+#include "iq_balance.h"
+
+
+iq_balance::iq_balance(const float alpha) {
+
+	m_alpha = alpha;
+	reset();
+}
+
+
+/*
+ * Forget the estimates, e.g., after the tuner moved.  The next block sets
+ * them outright.
+ */
+void iq_balance::reset() {
+
+	m_valid = false;
+	m_dc_i = m_dc_q = 0.0;
+	m_ii = m_qq = 1.0;
+	m_iq = 0.0;
+}
+
+
+// fold the sums over a block of s_len samples into the estimates
+void iq_balance::update(const unsigned int s_len, double si, double sq, double sii, double sqq, double siq) {
+
+	double mi, mq, a;
+
+	mi = si / s_len;
+	mq = sq / s_len;
+	a = m_valid? m_alpha : 1.0;
+	m_dc_i += a * (mi - m_dc_i);
+	m_dc_q += a * (mq - m_dc_q);
+	m_ii += a * (sii / s_len - mi * mi - m_ii);
+	m_qq += a * (sqq / s_len - mq * mq - m_qq);
+	m_iq += a * (siq / s_len - mi * mq - m_iq);
+	m_valid = true;
+}
+
+
+/*
+ * The estimates are the mean of each component and the covariance of what is
+ * left.  A signal from the air is circular, so I and Q should have the same
+ * power and be uncorrelated.  We take the part of Q that correlates with I
+ * out of Q and then scale Q to the power of I.
+ */
+void iq_balance::process(complex *s, const unsigned int s_len) {
+
+	unsigned int i;
+	float *f = (float *)s, di, dq, k1, k2, x, y;
+	double si = 0.0, sq = 0.0, sii = 0.0, sqq = 0.0, siq = 0.0, q1;
+
+	if(s_len >= MIN_BLOCK) {
+		for(i = 0; i < 2 * s_len; i += 2) {
+			si += f[i];
+			sq += f[i + 1];
+			sii += f[i] * f[i];
+			sqq += f[i + 1] * f[i + 1];
+			siq += f[i] * f[i + 1];
+		}
+		update(s_len, si, sq, sii, sqq, siq);
+	}
+	if(!m_valid)
+		return;
+
+	k1 = (m_ii > 0.0)? m_iq / m_ii : 0.0;
+	q1 = m_qq - k1 * m_iq;
+	k2 = (q1 > 0.0)? sqrt(m_ii / q1) : 1.0;
+	di = m_dc_i;
+	dq = m_dc_q;
+
+	// no dependencies between samples, so this vectorizes
+	for(i = 0; i < 2 * s_len; i += 2) {
+		x = f[i] - di;
+		y = f[i + 1] - dq;
+		f[i] = x;
+		f[i + 1] = (y - k1 * x) * k2;
+	}
+}
+
+
+/*
+ * The same for Q15 samples.  The sums are exact in 64-bit integers and the
+ * correction is applied with Q14 factors, so only the estimates, once per
+ * block, are worked out in floating point.
+ */
+void iq_balance::process(complex16 *s, const unsigned int s_len) {
+
+	unsigned int i;
+	int32_t di, dq, k1, k2, x, y;
+	int64_t si = 0, sq = 0, sii = 0, sqq = 0, siq = 0;
+	double q1, f;
+
+	if(s_len >= MIN_BLOCK) {
+		for(i = 0; i < s_len; i++) {
+			si += s[i].i;
+			sq += s[i].q;
+			sii += (int32_t)s[i].i * s[i].i;
+			sqq += (int32_t)s[i].q * s[i].q;
+			siq += (int32_t)s[i].i * s[i].q;
+		}
+		update(s_len, si, sq, sii, sqq, siq);
+	}
+	if(!m_valid)
+		return;
+
+	f = (m_ii > 0.0)? m_iq / m_ii : 0.0;
+	q1 = m_qq - f * m_iq;
+	k1 = (int32_t)lrint(f * (1 << 14));
+	k2 = (int32_t)lrint(((q1 > 0.0)? sqrt(m_ii / q1) : 1.0) * (1 << 14));
+	di = (int32_t)lrint(m_dc_i);
+	dq = (int32_t)lrint(m_dc_q);
+
+	for(i = 0; i < s_len; i++) {
+		x = s[i].i - di;
+		y = s[i].q - dq;
+		s[i].i = sat16(x);
+		s[i].q = sat16((int32_t)((((int64_t)y * (1 << 14) -
+		   (int64_t)k1 * x) * k2) >> 28));
+	}
+}
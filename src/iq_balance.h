@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * RTL dongles add a DC offset and don't quite keep I and Q the same size or
+ * at right angles.  This removes both from a stream of samples, using
+ * running estimates updated once per block.
+ */
+
+#pragma once
+
+#include "usrp_complex.h"
+
+class iq_balance {
+
+public:
+	iq_balance(const float alpha = 0.25);
+	void process(complex *s, const unsigned int s_len);
+	void process(complex16 *s, const unsigned int s_len);
+	void reset();
+	complex dc() { return complex(m_dc_i, m_dc_q); };
+
+private:
+	void update(const unsigned int s_len, double si, double sq, double sii, double sqq, double siq);
+
+	// blocks shorter than this don't update the estimates
+	static const unsigned int	MIN_BLOCK	= 256;
+
+	float		m_alpha;
+	bool		m_valid;
+	double		m_dc_i,
+			m_dc_q,
+			m_ii,
+			m_qq,
+			m_iq;
+};
@@ -60,18 +60,47 @@
 #include "arfcn_freq.h"
 #include "offset.h"
 #include "c0_detect.h"
+#include "coarse_detect.h"
+#include "kernels.h"
 #include "version.h"
-#ifdef _WIN32
 #include <getopt.h>
+#ifdef _WIN32
 #define basename(x) "meh"
 #define strtof strtod
 #endif
 
 #define GSM_RATE (1625000.0 / 6.0)
 
+// rtl-sdr devices a band scan can use at once
+#define MAX_DEVICES 16
+
+// long options, numbered past any short option
+enum {
+	OPT_LIST_KERNELS	= 256,
+	OPT_KERNELS		= 257
+};
+
+static const struct option long_options[] = {
+	{ "list-kernels",	no_argument,		0,	OPT_LIST_KERNELS },
+	{ "kernels",		required_argument,	0,	OPT_KERNELS },
+	{ 0,			0,			0,	0 }
+};
+
 
 int g_verbosity = 0;
 int g_debug = 0;
+unsigned int g_fcch_decimation = 1;
+int g_fcch_engine = fcch_detector::ENGINE_LMS;
+int g_fcch_gate = 0;
+int g_energy_gate = 0;
+int g_track = 0;
+int g_sch = 0;
+unsigned int g_integrate = 1;
+double g_pfa = 0.0;
+int g_coarse = 0;
+int g_refine = 0;
+int g_auto_gain = 0;
+int g_soa = 0;
 
 void usage(char *prog) {
 
@@ -89,13 +118,33 @@ void usage(char *prog) {
 	printf("\t-f\tfrequency of nearby GSM base station\n");
 	printf("\t-c\tchannel of nearby GSM base station\n");
 	printf("\t-b\tband indicator (GSM850, GSM-R, GSM900, EGSM, DCS, PCS)\n");
-	printf("\t-g\tgain in dB\n");
-	printf("\t-d\trtl-sdr device index\n");
+	printf("\t-g\tgain in dB, or auto to pick it from the samples\n");
+	printf("\t-d\trtl-sdr device index, or a list such as 0,1,2 to scan with several\n");
+	printf("\t-r\tcapture at r times the GSM rate and filter down (1, 4-11)\n");
+	printf("\t-o\toffset tuning, keeps the channel away from DC\n");
+	printf("\t-n\tno DC offset and IQ imbalance correction\n");
+	printf("\t-K\tmeasure the tuner settle time for this device and rate\n");
 	printf("\t-e\tinitial frequency error in ppm\n");
+	printf("\t-W\tsearch +/-100 ppm for the FCCH first (oscillator far off)\n");
 #if HAVE_DITHERING == 1
 	printf("\t-N\tdisable dithering (default: dithering enabled)\n");
 #endif
 	printf("\t-E\tmanual frequency offset in hz\n");
+	printf("\t-L\tlow-memory profile (smaller usb transfers)\n");
+	printf("\t-M\tdecimate by M before the FCCH adaptive filter\n");
+	printf("\t-x\tFCCH detector engine (lms, fft, compare)\n");
+	printf("\t-P\tonly run the FCCH engine where the phase difference is steady\n");
+	printf("\t-G\tskip the adaptive filter on blocks near the noise floor\n");
+	printf("\t-T\ttrack the FCCH schedule across captures\n");
+	printf("\t-S\tconfirm each FCCH with the SCH that follows it\n");
+	printf("\t-C\tclosed loop: apply the measured error and measure again\n");
+	printf("\t-I\taverage n FCCH bursts per offset (weak towers)\n");
+	printf("\t-p\tFCCH false alarm probability (default: fixed thresholds)\n");
+	printf("\t-l\tsample layout for channel power and plain lms (interleaved, soa)\n");
+	printf("\t-q\tfixed point samples and adaptive filter (plain lms only)\n");
+	printf("\t-B\tbenchmark the kernels in both layouts and exit\n");
+	printf("\t--kernels\tkernel set to use (scalar, sse4.1, avx2, avx512, neon)\n");
+	printf("\t--list-kernels\tlist the kernel sets this cpu can run and exit\n");
 	printf("\t-v\tverbose\n");
 	printf("\t-D\tenable debug messages\n");
 	printf("\t-h\thelp\n");
@@ -109,13 +158,26 @@ int main(int argc, char **argv) {
 	int c, antenna = 1, bi = BI_NOT_DEFINED, chan = -1, bts_scan = 0;
 	int ppm_error = 0, hz_adjust = 0;
 	int dithering = true;
-	unsigned int subdev = 0, decimation = 192;
+	int offset_tune = false;
+	int iq_correct = true;
+	int recalibrate = false;
+	int fixed = false;
+	int benchmark = false, list_kernels = false;
+	const char *kernels = 0;
+#ifdef LOW_MEMORY
+	int low_memory = true;
+#else
+	int low_memory = false;
+#endif
+	unsigned int subdev = 0, decimation = 1;
 	long int fpga_master_clock_freq = 52000000;
 	float gain = 0;
 	double freq = -1.0, fd;
-	usrp_source *u;
+	usrp_source *u, *us[MAX_DEVICES];
+	unsigned int devices[MAX_DEVICES] = { 0 };
+	int k, dev_count = 1;
 
-	while((c = getopt(argc, argv, "f:c:s:b:R:A:g:e:E:Nd:vDh?")) != EOF) {
+	while((c = getopt_long(argc, argv, "f:c:s:b:R:A:g:e:E:NLM:x:PGTSCI:p:r:onKd:l:qBWvDh?", long_options, 0)) != EOF) {
 		switch(c) {
 			case 'f':
 				freq = strtod(optarg, 0);
@@ -177,7 +239,10 @@ int main(int argc, char **argv) {
 				break;
 
 			case 'g':
-				gain = strtof(optarg, 0) * 10;
+				if(!strcmp(optarg, "auto"))
+					g_auto_gain = 1;
+				else
+					gain = strtof(optarg, 0) * 10;
 				break;
 
 			case 'F':
@@ -195,6 +260,10 @@ int main(int argc, char **argv) {
 				ppm_error = strtol(optarg, 0, 0);
 				break;
 
+			case 'W':
+				g_coarse = 1;
+				break;
+
 			case 'N':
 				dithering = false;
 				break;
@@ -203,8 +272,113 @@ int main(int argc, char **argv) {
 				hz_adjust = strtol(optarg, 0, 0);
 				break;
 
+			case 'L':
+				low_memory = true;
+				break;
+
+			case 'M':
+				g_fcch_decimation = strtoul(optarg, 0, 0);
+				break;
+
+			case 'x':
+				if(!strcmp(optarg, "lms")) {
+					g_fcch_engine = fcch_detector::ENGINE_LMS;
+				} else if(!strcmp(optarg, "fft")) {
+					g_fcch_engine = fcch_detector::ENGINE_FFT;
+				} else if(!strcmp(optarg, "compare")) {
+					g_fcch_engine = fcch_detector::ENGINE_COMPARE;
+				} else {
+					fprintf(stderr, "error: bad engine: "
+					   "``%s''\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+
+			case 'P':
+				g_fcch_gate = 1;
+				break;
+
+			case 'G':
+				g_energy_gate = 1;
+				break;
+
+			case 'T':
+				g_track = 1;
+				break;
+
+			case 'S':
+				g_sch = 1;
+				break;
+
+			case 'I':
+				g_integrate = strtoul(optarg, 0, 0);
+				break;
+
+			case 'C':
+				g_refine = 1;
+				break;
+
+			case 'p':
+				g_pfa = strtod(optarg, 0);
+				break;
+
+			case 'r':
+				decimation = strtoul(optarg, 0, 0);
+				break;
+
+			case 'o':
+				offset_tune = true;
+				break;
+
+			case 'n':
+				iq_correct = false;
+				break;
+
+			case 'K':
+				recalibrate = true;
+				break;
+
 			case 'd':
-				subdev = strtol(optarg, 0, 0);
+				endptr = optarg;
+				dev_count = 0;
+				do {
+					if(dev_count == MAX_DEVICES) {
+						fprintf(stderr, "error: more than %d "
+						   "devices\n", MAX_DEVICES);
+						usage(argv[0]);
+					}
+					devices[dev_count++] = strtoul(endptr,
+					   &endptr, 0);
+				} while(*endptr++ == ',');
+				subdev = devices[0];
+				break;
+
+			case 'l':
+				if(!strcmp(optarg, "interleaved")) {
+					g_soa = 0;
+				} else if(!strcmp(optarg, "soa")) {
+					g_soa = 1;
+				} else {
+					fprintf(stderr, "error: bad layout: "
+					   "``%s''\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+
+			case 'q':
+				fixed = true;
+				break;
+
+			case 'B':
+				benchmark = true;
+				break;
+
+			case OPT_LIST_KERNELS:
+				list_kernels = true;
+				break;
+
+			case OPT_KERNELS:
+				kernels = optarg;
 				break;
 
 			case 'v':
@@ -224,6 +398,18 @@ int main(int argc, char **argv) {
 
 	}
 
+	// before any thread can call a kernel
+	if(kernel_select(kernels))
+		usage(argv[0]);
+	if(list_kernels) {
+		kernel_list();
+		return 0;
+	}
+	if(benchmark) {
+		kernel_benchmark();
+		return 0;
+	}
+
 	// sanity check frequency / channel
 	if(bts_scan) {
 		if(bi == BI_NOT_DEFINED) {
@@ -267,39 +453,84 @@ int main(int argc, char **argv) {
 		printf("debug: RX Subdev Spec        :\t%s\n", subdev? "B" : "A");
 		printf("debug: Antenna               :\t%s\n", antenna? "RX2" : "TX/RX");
 		printf("debug: Gain                  :\t%f\n", gain);
+		printf("debug: FCCH decimation       :\t%u\n", g_fcch_decimation);
+		printf("debug: FCCH engine           :\t%d\n", g_fcch_engine);
 	}
 
-	u = new usrp_source(decimation, fpga_master_clock_freq);
-	if(!u) {
-		fprintf(stderr, "error: usrp_source\n");
-		return -1;
-	}
-	if(u->open(subdev) == -1) {
-		fprintf(stderr, "error: usrp_source::open\n");
-		return -1;
+	/*
+	 * The fixed point path is the adaptive filter over whole captures at
+	 * the GSM rate and nothing else.
+	 */
+	if(fixed && ((decimation > 1) || g_soa || g_fcch_decimation > 1 ||
+	   (g_fcch_engine != fcch_detector::ENGINE_LMS) || g_fcch_gate ||
+	   g_energy_gate || g_track || g_sch || (g_integrate > 1))) {
+		fprintf(stderr, "error: -q can't be used with -r, -l, -M, -x, "
+		   "-P, -G, -T, -S or -I\n");
+		usage(argv[0]);
 	}
 
-	/* Enable/disable dithering */
-	if (!u->set_dithering(dithering)) {
-		fprintf(stderr, "error: usrp_source::set_dithering\n");
-	}
+	// only a band scan can share the work between devices
+	if(!bts_scan)
+		dev_count = 1;
 
-//	u->set_antenna(antenna);
-	if (gain != 0) {
-		if(!u->set_gain(gain)) {
-			fprintf(stderr, "error: usrp_source::set_gain\n");
+	for(k = 0; k < dev_count; k++) {
+		us[k] = new usrp_source(decimation, fpga_master_clock_freq);
+		if(!us[k]) {
+			fprintf(stderr, "error: usrp_source\n");
 			return -1;
 		}
-	}
-
-	if (ppm_error != 0) {
-		if(u->set_freq_correction(ppm_error) < 0) {
-			fprintf(stderr, "error: usrp_source::set_freq_correction\n");
+		us[k]->set_low_memory(low_memory);
+		us[k]->set_offset_tuning(offset_tune);
+		us[k]->set_iq_balance(iq_correct);
+		us[k]->set_soa(g_soa);
+		us[k]->set_fixed(fixed);
+		if(us[k]->open(devices[k]) == -1) {
+			fprintf(stderr, "error: usrp_source::open\n");
 			return -1;
 		}
+
+		/* Enable/disable dithering */
+		if (!us[k]->set_dithering(dithering)) {
+			fprintf(stderr, "error: usrp_source::set_dithering\n");
+		}
+
+		// measured with -K, then flush() only drops what it must
+		us[k]->calibrate_settle(bts_scan?
+		   arfcn_to_freq(first_chan(bi), &bi) : freq, recalibrate);
+
+//		us[k]->set_antenna(antenna);
+		if (gain != 0) {
+			if(!us[k]->set_gain(gain)) {
+				fprintf(stderr, "error: usrp_source::set_gain\n");
+				return -1;
+			}
+		}
+
+		if (ppm_error != 0) {
+			if(us[k]->set_freq_correction(ppm_error) < 0) {
+				fprintf(stderr, "error: usrp_source::set_freq_correction\n");
+				return -1;
+			}
+		}
 	}
+	u = us[0];
 
 	if(!bts_scan) {
+		if(g_auto_gain) {
+			if(!u->tune(freq+hz_adjust)) {
+				fprintf(stderr, "error: usrp_source::tune\n");
+				return -1;
+			}
+			if(u->auto_gain() < 0) {
+				fprintf(stderr, "error: usrp_source::auto_gain\n");
+				return -1;
+			}
+		}
+
+		// a badly off oscillator puts the FCCH out of reach without this
+		if(g_coarse)
+			coarse_detect(u, freq);
+
 		if(!u->tune(freq+hz_adjust)) {
 			fprintf(stderr, "error: usrp_source::tune\n");
 			return -1;
@@ -320,5 +551,5 @@ int main(int argc, char **argv) {
 	fprintf(stderr, "%s: Scanning for %s base stations.\n",
 	   basename(argv[0]), bi_to_str(bi));
 
-	return c0_detect(u, bi);
+	return c0_detect(us, dev_count, bi);
 }
@@ -0,0 +1,931 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "kernels.h"
+#include "soa_buffer.h"
+
+
+static void convert_u8_scalar(const unsigned char *u, const unsigned int n, complex *c) {
+
+	unsigned int i;
+
+	for(i = 0; i < n; i++)
+		c[i] = complex((u[2 * i] - 127) * 256, (u[2 * i + 1] - 127) * 256);
+}
+
+
+static double norm2_scalar(const complex *s, const unsigned int len) {
+
+	unsigned int n;
+	double e = 0.0;
+
+	for(n = 0; n < len; n++)
+		e += norm(s[n]);
+
+	return e;
+}
+
+
+double norm2_soa(const float *i, const float *q, const unsigned int len) {
+
+	unsigned int n;
+	double e = 0.0;
+
+	for(n = 0; n < len; n++)
+		e += i[n] * i[n] + q[n] * q[n];
+
+	return e;
+}
+
+
+static unsigned int power_peak_scalar(const complex *s, const unsigned int len, float *max, float *sum) {
+
+	unsigned int n, max_n = 0;
+	float p, max_p = -1.0, sum_p = 0.0;
+
+	for(n = 0; n < len; n++) {
+		p = norm(s[n]);
+		sum_p += p;
+		if(p > max_p) {
+			max_p = p;
+			max_n = n;
+		}
+	}
+	if(max)
+		*max = max_p;
+	if(sum)
+		*sum = sum_p;
+
+	return max_n;
+}
+
+
+unsigned int power_peak_soa(const float *i, const float *q, const unsigned int len, float *max, float *sum) {
+
+	unsigned int n, max_n = 0;
+	float p, max_p = -1.0, sum_p = 0.0;
+
+	for(n = 0; n < len; n++) {
+		p = i[n] * i[n] + q[n] * q[n];
+		sum_p += p;
+		if(p > max_p) {
+			max_p = p;
+			max_n = n;
+		}
+	}
+	if(max)
+		*max = max_p;
+	if(sum)
+		*sum = sum_p;
+
+	return max_n;
+}
+
+
+/*
+ * 	y = sum(conj(w[k]) * x[len - 1 - k])
+ * 	e = d - y
+ * 	w[k] += G * conj(e) * x[len - 1 - k]
+ */
+static complex lms_step_scalar(complex *w, const complex *x, const unsigned int len, const float G, const complex d) {
+
+	const unsigned int n = len - 1;
+
+	unsigned int k;
+	complex y = 0.0, e;
+
+	for(k = 0; k < len; k++)
+		y += std::conj(w[k]) * x[n - k];
+	e = d - y;
+	for(k = 0; k < len; k++)
+		w[k] += G * std::conj(e) * x[n - k];
+
+	return e;
+}
+
+
+void lms_step_soa(float *w_i, float *w_q, const float *x_i, const float *x_q, const unsigned int len, const float G, const float d_i, const float d_q, float *e_i, float *e_q) {
+
+	const unsigned int n = len - 1;
+
+	unsigned int k;
+	float y_i = 0.0, y_q = 0.0, g_i, g_q;
+
+	for(k = 0; k < len; k++) {
+		y_i += w_i[k] * x_i[n - k] + w_q[k] * x_q[n - k];
+		y_q += w_i[k] * x_q[n - k] - w_q[k] * x_i[n - k];
+	}
+	*e_i = d_i - y_i;
+	*e_q = d_q - y_q;
+
+	// G * conj(e)
+	g_i = G * *e_i;
+	g_q = -G * *e_q;
+	for(k = 0; k < len; k++) {
+		w_i[k] += g_i * x_i[n - k] - g_q * x_q[n - k];
+		w_q[k] += g_i * x_q[n - k] + g_q * x_i[n - k];
+	}
+}
+
+
+/*
+ * The same kernels written with W independent partial sums, so that the
+ * compiler can keep W lanes of the vector unit busy, and compiled below once
+ * for each instruction set.  They add in a different order from the scalar
+ * ones and so can differ from them in the last bits.
+ */
+#ifdef __GNUC__
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE	inline
+#endif
+
+template <unsigned int W>
+static ALWAYS_INLINE double norm2_body(const complex *s, const unsigned int len) {
+
+	unsigned int n, k;
+	const float *f = (const float *)s;
+	double acc[W], e = 0.0;
+
+	for(k = 0; k < W; k++)
+		acc[k] = 0.0;
+	for(n = 0; n + W <= len; n += W)
+		for(k = 0; k < W; k++)
+			acc[k] += f[2 * (n + k)] * f[2 * (n + k)] +
+			   f[2 * (n + k) + 1] * f[2 * (n + k) + 1];
+	for(; n < len; n++)
+		acc[0] += norm(s[n]);
+	for(k = 0; k < W; k++)
+		e += acc[k];
+
+	return e;
+}
+
+
+/*
+ * Each lane keeps its own peak, the first it saw, and the earliest of the
+ * highest wins so the index is the one the scalar kernel finds.
+ */
+template <unsigned int W>
+static ALWAYS_INLINE unsigned int power_peak_body(const complex *s, const unsigned int len, float *max, float *sum) {
+
+	unsigned int n, k, max_n = 0, idx[W];
+	const float *f = (const float *)s;
+	float p, m[W], acc[W], max_p = -1.0, sum_p = 0.0;
+
+	for(k = 0; k < W; k++) {
+		m[k] = -1.0;
+		acc[k] = 0.0;
+		idx[k] = 0;
+	}
+	for(n = 0; n + W <= len; n += W) {
+		for(k = 0; k < W; k++) {
+			p = f[2 * (n + k)] * f[2 * (n + k)] +
+			   f[2 * (n + k) + 1] * f[2 * (n + k) + 1];
+			acc[k] += p;
+			if(p > m[k]) {
+				m[k] = p;
+				idx[k] = n + k;
+			}
+		}
+	}
+	for(k = 0; n + k < len; k++) {
+		p = norm(s[n + k]);
+		acc[k] += p;
+		if(p > m[k]) {
+			m[k] = p;
+			idx[k] = n + k;
+		}
+	}
+	for(k = 0; k < W; k++) {
+		sum_p += acc[k];
+		if((m[k] > max_p) || ((m[k] == max_p) && (idx[k] < max_n))) {
+			max_p = m[k];
+			max_n = idx[k];
+		}
+	}
+	if(max)
+		*max = max_p;
+	if(sum)
+		*sum = sum_p;
+
+	return max_n;
+}
+
+
+template <unsigned int W>
+static ALWAYS_INLINE complex lms_step_body(complex *w, const complex *x, const unsigned int len, const float G, const complex d) {
+
+	const unsigned int n = len - 1;
+
+	unsigned int k, j;
+	float *wf = (float *)w;
+	const float *xf = (const float *)x;
+	float y_i[W], y_q[W], e_i, e_q, g_i, g_q, w_i, w_q, x_i, x_q;
+
+	for(j = 0; j < W; j++) {
+		y_i[j] = 0.0;
+		y_q[j] = 0.0;
+	}
+	for(k = 0; k + W <= len; k += W) {
+		for(j = 0; j < W; j++) {
+			w_i = wf[2 * (k + j)];
+			w_q = wf[2 * (k + j) + 1];
+			x_i = xf[2 * (n - k - j)];
+			x_q = xf[2 * (n - k - j) + 1];
+			y_i[j] += w_i * x_i + w_q * x_q;
+			y_q[j] += w_i * x_q - w_q * x_i;
+		}
+	}
+	for(j = 0; k + j < len; j++) {
+		w_i = wf[2 * (k + j)];
+		w_q = wf[2 * (k + j) + 1];
+		x_i = xf[2 * (n - k - j)];
+		x_q = xf[2 * (n - k - j) + 1];
+		y_i[j] += w_i * x_i + w_q * x_q;
+		y_q[j] += w_i * x_q - w_q * x_i;
+	}
+	e_i = d.real();
+	e_q = d.imag();
+	for(j = 0; j < W; j++) {
+		e_i -= y_i[j];
+		e_q -= y_q[j];
+	}
+
+	// G * conj(e)
+	g_i = G * e_i;
+	g_q = -G * e_q;
+	for(k = 0; k < len; k++) {
+		x_i = xf[2 * (n - k)];
+		x_q = xf[2 * (n - k) + 1];
+		wf[2 * k] += g_i * x_i - g_q * x_q;
+		wf[2 * k + 1] += g_i * x_q + g_q * x_i;
+	}
+
+	return complex(e_i, e_q);
+}
+
+
+#define KERNEL_SET(name, attr, W)						\
+static attr double norm2_##name(const complex *s, const unsigned int len) {	\
+	return norm2_body<W>(s, len);						\
+}										\
+static attr unsigned int power_peak_##name(const complex *s, const unsigned int len, float *max, float *sum) {	\
+	return power_peak_body<W>(s, len, max, sum);				\
+}										\
+static attr complex lms_step_##name(complex *w, const complex *x, const unsigned int len, const float G, const complex d) {	\
+	return lms_step_body<(W > 8)? 8 : W>(w, x, len, G, d);		\
+}
+
+/*
+ * The compiler won't widen bytes to floats by itself at -O2, so the
+ * conversion is written out for each instruction set.  (u - 127) * 256 is
+ * done in integers, where it is exact, and converted last.
+ */
+static inline void convert_u8_tail(const unsigned char *u, unsigned int i, const unsigned int n, complex *c) {
+
+	float *f = (float *)c;
+
+	for(; i < 2 * n; i++)
+		f[i] = (u[i] - 127) * 256;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+KERNEL_SET(sse41, __attribute__((target("sse4.1"))), 4)
+KERNEL_SET(avx2, __attribute__((target("avx2,fma"))), 8)
+KERNEL_SET(avx512, __attribute__((target("avx512f,avx512dq,avx512vl,avx512bw"))), 16)
+
+static __attribute__((target("sse4.1"))) void convert_u8_sse41(const unsigned char *u, const unsigned int n, complex *c) {
+
+	unsigned int i;
+	int32_t b;
+	float *f = (float *)c;
+	__m128i v;
+
+	for(i = 0; i + 4 <= 2 * n; i += 4) {
+		memcpy(&b, u + i, 4);
+		v = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(b));
+		v = _mm_slli_epi32(_mm_sub_epi32(v, _mm_set1_epi32(127)), 8);
+		_mm_storeu_ps(f + i, _mm_cvtepi32_ps(v));
+	}
+	convert_u8_tail(u, i, n, c);
+}
+
+
+static __attribute__((target("avx2"))) void convert_u8_avx2(const unsigned char *u, const unsigned int n, complex *c) {
+
+	unsigned int i;
+	float *f = (float *)c;
+	__m256i v;
+
+	for(i = 0; i + 8 <= 2 * n; i += 8) {
+		v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(u + i)));
+		v = _mm256_slli_epi32(_mm256_sub_epi32(v, _mm256_set1_epi32(127)), 8);
+		_mm256_storeu_ps(f + i, _mm256_cvtepi32_ps(v));
+	}
+	convert_u8_tail(u, i, n, c);
+}
+
+
+static __attribute__((target("avx512f"))) void convert_u8_avx512(const unsigned char *u, const unsigned int n, complex *c) {
+
+	unsigned int i;
+	float *f = (float *)c;
+	__m512i v;
+
+	// the zero masked forms, as the plain ones trip -Wmaybe-uninitialized in gcc 12
+	for(i = 0; i + 16 <= 2 * n; i += 16) {
+		v = _mm512_maskz_cvtepu8_epi32(0xffff, _mm_loadu_si128((const __m128i *)(u + i)));
+		v = _mm512_maskz_slli_epi32(0xffff, _mm512_sub_epi32(v, _mm512_set1_epi32(127)), 8);
+		_mm512_storeu_ps(f + i, _mm512_maskz_cvtepi32_ps(0xffff, v));
+	}
+	convert_u8_tail(u, i, n, c);
+}
+#endif
+
+// NEON is part of the baseline wherever the compiler says it is there
+#ifdef __ARM_NEON
+KERNEL_SET(neon, , 4)
+
+static void convert_u8_neon(const unsigned char *u, const unsigned int n, complex *c) {
+
+	unsigned int i;
+	float *f = (float *)c;
+	int16x8_t v;
+
+	for(i = 0; i + 8 <= 2 * n; i += 8) {
+		v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u + i)));
+		v = vsubq_s16(v, vdupq_n_s16(127));
+		vst1q_f32(f + i, vcvtq_f32_s32(vshlq_n_s32(vmovl_s16(vget_low_s16(v)), 8)));
+		vst1q_f32(f + i + 4, vcvtq_f32_s32(vshlq_n_s32(vmovl_s16(vget_high_s16(v)), 8)));
+	}
+	convert_u8_tail(u, i, n, c);
+}
+#endif
+
+
+static inline int16_t add_sat16(const int16_t a, int64_t b) {
+
+	b += a;
+	return (b > 32767)? 32767 : ((b < -32768)? -32768 : b);
+}
+
+
+int64_t norm2_q15(const complex16 *s, const unsigned int len) {
+
+	unsigned int n;
+	int64_t e = 0;
+
+	for(n = 0; n < len; n++)
+		e += (int64_t)s[n].i * s[n].i + (int64_t)s[n].q * s[n].q;
+
+	return e;
+}
+
+
+/*
+ * G as g * 2^-shift with g in [2^14, 2^15), so the step keeps 15 bits
+ * rather than being rounded to a power of two.
+ */
+void q15_step(const double G, int16_t *g, unsigned int *shift) {
+
+	double m;
+
+	*shift = (unsigned int)floor(log2(1.0 / G)) + 15;
+	m = round(ldexp(G, *shift));
+	*g = (m > 32767.0)? 32767 : (int16_t)m;
+}
+
+
+// a * b in Q15, truncated, as vqdmulhq_s16() does it
+static inline int16_t mul_q15(const int16_t a, const int16_t b) {
+
+	return sat16(((int32_t)a * b) >> 15);
+}
+
+
+// d - y within 17 bits
+static inline int32_t sat17(const int32_t x) {
+
+	return (x > 65535)? 65535 : ((x < -65535)? -65535 : x);
+}
+
+
+// a 17-bit error times g, rounded to 16 bits, and the error halved
+static inline void error_q15(const int32_t e_i, const int32_t e_q, const int16_t g, complex16 *eg, complex16 *e) {
+
+	eg->i = ((int64_t)e_i * g + (1 << 15)) >> 16;
+	eg->q = ((int64_t)e_q * g + (1 << 15)) >> 16;
+	e->i = sat16((e_i + 1) >> 1);
+	e->q = sat16((e_q + 1) >> 1);
+}
+
+
+/*
+ * p / 2^r rounded, or p * 2^-r for negative r, saturated to 16 bits, as
+ * vqrshlq_s32() then vqmovn_s32() do it.
+ */
+static inline int16_t shift_sat16(const int32_t p, const int r) {
+
+	int64_t v = p;
+
+	if(r > 0)
+		v = (v + (1LL << (r - 1))) >> r;
+	else if(r < 0)
+		v *= 1LL << ((-r < 32)? -r : 32);
+	return (v > 32767)? 32767 : ((v < -32768)? -32768 : v);
+}
+
+
+/*
+ * lms_step() with w in Q15 and x and d in the units of the samples.  The
+ * error can reach twice full scale, so it is kept to 17 bits and returned
+ * halved.  The step G is g * 2^-shift in those units squared.  e * g is
+ * rounded to 16 bits first, as e * g / 2^16, so the tap update
+ * G * conj(e) * x, in Q15, is that times x shifted right by shift - 31.
+ */
+static complex16 lms_step_q15_scalar(complex16 *w, const complex16 *x, const unsigned int len, const int16_t g, const unsigned int shift, const complex16 d) {
+
+	const unsigned int n = len - 1;
+	const int r = (int)shift - 31;
+
+	unsigned int k;
+	int32_t y_i = 0, y_q = 0, p_i, p_q;
+	complex16 e, eg;
+
+	for(k = 0; k < len; k++) {
+		y_i += mul_q15(w[k].i, x[n - k].i);
+		y_i += mul_q15(w[k].q, x[n - k].q);
+		y_q += mul_q15(w[k].i, x[n - k].q);
+		y_q -= mul_q15(w[k].q, x[n - k].i);
+	}
+	error_q15(sat17(d.i - y_i), sat17(d.q - y_q), g, &eg, &e);
+	for(k = 0; k < len; k++) {
+		p_i = (int32_t)eg.i * x[n - k].i + (int32_t)eg.q * x[n - k].q;
+		p_q = (int32_t)eg.i * x[n - k].q - (int32_t)eg.q * x[n - k].i;
+		w[k].i = add_sat16(w[k].i, shift_sat16(p_i, r));
+		w[k].q = add_sat16(w[k].q, shift_sat16(p_q, r));
+	}
+
+	return e;
+}
+
+
+#ifdef __ARM_NEON
+// x[n - k - 7], ..., x[n - k] split into I and Q, in the order of w[k], ...
+static inline int16x8x2_t load_rev_q15(const complex16 *x) {
+
+	int16x8x2_t v = vld2q_s16((const int16_t *)x);
+
+	v.val[0] = vrev64q_s16(v.val[0]);
+	v.val[0] = vcombine_s16(vget_high_s16(v.val[0]), vget_low_s16(v.val[0]));
+	v.val[1] = vrev64q_s16(v.val[1]);
+	v.val[1] = vcombine_s16(vget_high_s16(v.val[1]), vget_low_s16(v.val[1]));
+	return v;
+}
+
+
+static inline int32_t sum_s32(const int32x4_t v) {
+
+	return vgetq_lane_s32(v, 0) + vgetq_lane_s32(v, 1) +
+	   vgetq_lane_s32(v, 2) + vgetq_lane_s32(v, 3);
+}
+
+
+/*
+ * Eight taps at a time: vqdmulhq_s16() makes the Q15 products, which are
+ * summed in 32 bits, and the updates are shifted and narrowed with
+ * saturation and added to the taps with vqaddq_s16().
+ */
+static complex16 lms_step_q15_neon(complex16 *w, const complex16 *x, const unsigned int len, const int16_t g, const unsigned int shift, const complex16 d) {
+
+	const unsigned int n = len - 1;
+	const int r = (int)shift - 31;
+	const int32x4_t vr = vdupq_n_s32(-r);
+
+	unsigned int k;
+	int32_t y_i, y_q, p_i, p_q;
+	int32x4_t a_i = vdupq_n_s32(0), a_q = vdupq_n_s32(0),
+	   s_q = vdupq_n_s32(0), u_i, u_q, v_i, v_q;
+	int16x8x2_t vw, vx;
+	int16x8_t e_i, e_q;
+	complex16 e, eg;
+
+	for(k = 0; k + 8 <= len; k += 8) {
+		vw = vld2q_s16((const int16_t *)(w + k));
+		vx = load_rev_q15(x + n - k - 7);
+		a_i = vpadalq_s16(a_i, vqdmulhq_s16(vw.val[0], vx.val[0]));
+		a_i = vpadalq_s16(a_i, vqdmulhq_s16(vw.val[1], vx.val[1]));
+		a_q = vpadalq_s16(a_q, vqdmulhq_s16(vw.val[0], vx.val[1]));
+		s_q = vpadalq_s16(s_q, vqdmulhq_s16(vw.val[1], vx.val[0]));
+	}
+	y_i = sum_s32(a_i);
+	y_q = sum_s32(a_q) - sum_s32(s_q);
+	for(; k < len; k++) {
+		y_i += mul_q15(w[k].i, x[n - k].i);
+		y_i += mul_q15(w[k].q, x[n - k].q);
+		y_q += mul_q15(w[k].i, x[n - k].q);
+		y_q -= mul_q15(w[k].q, x[n - k].i);
+	}
+	error_q15(sat17(d.i - y_i), sat17(d.q - y_q), g, &eg, &e);
+	e_i = vdupq_n_s16(eg.i);
+	e_q = vdupq_n_s16(eg.q);
+	for(k = 0; k + 8 <= len; k += 8) {
+		vw = vld2q_s16((const int16_t *)(w + k));
+		vx = load_rev_q15(x + n - k - 7);
+
+		// conj(eg) * x in 32 bits, the low four taps and the high four
+		u_i = vmull_s16(vget_low_s16(e_i), vget_low_s16(vx.val[0]));
+		u_i = vmlal_s16(u_i, vget_low_s16(e_q), vget_low_s16(vx.val[1]));
+		v_i = vmull_s16(vget_high_s16(e_i), vget_high_s16(vx.val[0]));
+		v_i = vmlal_s16(v_i, vget_high_s16(e_q), vget_high_s16(vx.val[1]));
+		u_q = vmull_s16(vget_low_s16(e_i), vget_low_s16(vx.val[1]));
+		u_q = vmlsl_s16(u_q, vget_low_s16(e_q), vget_low_s16(vx.val[0]));
+		v_q = vmull_s16(vget_high_s16(e_i), vget_high_s16(vx.val[1]));
+		v_q = vmlsl_s16(v_q, vget_high_s16(e_q), vget_high_s16(vx.val[0]));
+
+		vw.val[0] = vqaddq_s16(vw.val[0],
+		   vcombine_s16(vqmovn_s32(vqrshlq_s32(u_i, vr)),
+		   vqmovn_s32(vqrshlq_s32(v_i, vr))));
+		vw.val[1] = vqaddq_s16(vw.val[1],
+		   vcombine_s16(vqmovn_s32(vqrshlq_s32(u_q, vr)),
+		   vqmovn_s32(vqrshlq_s32(v_q, vr))));
+		vst2q_s16((int16_t *)(w + k), vw);
+	}
+	for(; k < len; k++) {
+		p_i = (int32_t)eg.i * x[n - k].i + (int32_t)eg.q * x[n - k].q;
+		p_q = (int32_t)eg.i * x[n - k].q - (int32_t)eg.q * x[n - k].i;
+		w[k].i = add_sat16(w[k].i, shift_sat16(p_i, r));
+		w[k].q = add_sat16(w[k].q, shift_sat16(p_q, r));
+	}
+
+	return e;
+}
+#endif
+
+
+/*
+ * Kernel registry.  kernel_select() picks one set at startup, before any
+ * thread is running, and every call below goes through it.
+ */
+struct kernel_set {
+	const char	*name;
+	bool		(*supported)();
+	void		(*convert_u8)(const unsigned char *, const unsigned int, complex *);
+	double		(*norm2)(const complex *, const unsigned int);
+	unsigned int	(*power_peak)(const complex *, const unsigned int, float *, float *);
+	complex		(*lms_step)(complex *, const complex *, const unsigned int, const float, const complex);
+	complex16	(*lms_step_q15)(complex16 *, const complex16 *, const unsigned int, const int16_t, const unsigned int, const complex16);
+};
+
+static bool cpu_any() {
+
+	return true;
+}
+
+#ifdef KERNELS_X86
+static bool cpu_sse41() {
+
+	return __builtin_cpu_supports("sse4.1");
+}
+
+
+static bool cpu_avx2() {
+
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+
+static bool cpu_avx512() {
+
+	return __builtin_cpu_supports("avx512f") &&
+	   __builtin_cpu_supports("avx512dq") &&
+	   __builtin_cpu_supports("avx512vl") &&
+	   __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+// from the most portable to the fastest
+static const kernel_set kernel_sets[] = {
+	{ "scalar", cpu_any, convert_u8_scalar, norm2_scalar, power_peak_scalar, lms_step_scalar, lms_step_q15_scalar },
+#ifdef KERNELS_X86
+	{ "sse4.1", cpu_sse41, convert_u8_sse41, norm2_sse41, power_peak_sse41, lms_step_sse41, lms_step_q15_scalar },
+	{ "avx2", cpu_avx2, convert_u8_avx2, norm2_avx2, power_peak_avx2, lms_step_avx2, lms_step_q15_scalar },
+	{ "avx512", cpu_avx512, convert_u8_avx512, norm2_avx512, power_peak_avx512, lms_step_avx512, lms_step_q15_scalar },
+#endif
+#ifdef __ARM_NEON
+	{ "neon", cpu_any, convert_u8_neon, norm2_neon, power_peak_neon, lms_step_neon, lms_step_q15_neon },
+#endif
+};
+
+static const unsigned int kernel_set_count = sizeof(kernel_sets) / sizeof(kernel_sets[0]);
+
+static const kernel_set *k_set = &kernel_sets[0];
+
+
+int kernel_select(const char *name) {
+
+	unsigned int n;
+
+	if(!name) {
+		for(n = kernel_set_count; n > 0; n--) {
+			if(kernel_sets[n - 1].supported()) {
+				k_set = &kernel_sets[n - 1];
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	for(n = 0; n < kernel_set_count; n++) {
+		if(!strcmp(kernel_sets[n].name, name)) {
+			if(!kernel_sets[n].supported()) {
+				fprintf(stderr, "error: this cpu can't run the "
+				   "%s kernels\n", name);
+				return -1;
+			}
+			k_set = &kernel_sets[n];
+			return 0;
+		}
+	}
+	fprintf(stderr, "error: no such kernels: ``%s''\n", name);
+
+	return -1;
+}
+
+
+const char *kernel_name() {
+
+	return k_set->name;
+}
+
+
+void kernel_list() {
+
+	unsigned int n;
+	const kernel_set *best = 0;
+
+	for(n = 0; n < kernel_set_count; n++)
+		if(kernel_sets[n].supported())
+			best = &kernel_sets[n];
+	for(n = 0; n < kernel_set_count; n++) {
+		printf("%-8s\t%s\n", kernel_sets[n].name,
+		   (&kernel_sets[n] == best)? "default" :
+		   (kernel_sets[n].supported()? "supported" : "not supported"));
+	}
+}
+
+
+void convert_u8(const unsigned char *u, const unsigned int n, complex *c) {
+
+	k_set->convert_u8(u, n, c);
+}
+
+
+double norm2(const complex *s, const unsigned int len) {
+
+	return k_set->norm2(s, len);
+}
+
+
+unsigned int power_peak(const complex *s, const unsigned int len, float *max, float *sum) {
+
+	return k_set->power_peak(s, len, max, sum);
+}
+
+
+complex lms_step(complex *w, const complex *x, const unsigned int len, const float G, const complex d) {
+
+	return k_set->lms_step(w, x, len, G, d);
+}
+
+
+complex16 lms_step_q15(complex16 *w, const complex16 *x, const unsigned int len, const int16_t g, const unsigned int shift, const complex16 d) {
+
+	return k_set->lms_step_q15(w, x, len, g, shift, d);
+}
+
+
+/*
+ * Kernel benchmark:  BENCH_LEN random samples, each kernel run over them
+ * until BENCH_TIME seconds have gone by.  The samples are scaled to +/-1 so
+ * that BENCH_G keeps the adaptive filter stable.
+ */
+static const unsigned int	BENCH_LEN	= 65536;
+static const double		BENCH_TIME	= 0.25;
+static const unsigned int	BENCH_TAPS	= 17;
+static const float		BENCH_G		= 0.01;
+
+static volatile float bench_sink;
+
+enum {
+	K_NORM2	= 0,
+	K_PEAK	= 1,
+	K_LMS	= 2,
+	K_COUNT	= 3
+};
+
+static const char * const bench_name[K_COUNT] = {
+	"norm2",
+	"power_peak",
+	"lms_step"
+};
+
+
+static void bench_run(int kernel, bool soa, const complex *s, soa_buffer *b) {
+
+	const unsigned int steps = BENCH_LEN - BENCH_TAPS;
+
+	unsigned int n;
+	float m, sum, e_i, e_q, w_i[BENCH_TAPS] = { 0 }, w_q[BENCH_TAPS] = { 0 };
+	complex w[BENCH_TAPS], e;
+
+	switch(kernel) {
+		case K_NORM2:
+			if(soa)
+				bench_sink = norm2_soa(b->i(), b->q(), BENCH_LEN);
+			else
+				bench_sink = norm2(s, BENCH_LEN);
+			break;
+
+		case K_PEAK:
+			if(soa)
+				power_peak_soa(b->i(), b->q(), BENCH_LEN, &m, &sum);
+			else
+				power_peak(s, BENCH_LEN, &m, &sum);
+			bench_sink = m + sum;
+			break;
+
+		case K_LMS:
+			for(n = 0; n < BENCH_TAPS; n++)
+				w[n] = 0.0;
+			sum = 0.0;
+			for(n = 0; n < steps; n++) {
+				if(soa) {
+					lms_step_soa(w_i, w_q, b->i() + n, b->q() + n,
+					   BENCH_TAPS, BENCH_G, b->i()[n + BENCH_TAPS],
+					   b->q()[n + BENCH_TAPS], &e_i, &e_q);
+					sum += e_i;
+				} else {
+					e = lms_step(w, s + n, BENCH_TAPS, BENCH_G,
+					   s[n + BENCH_TAPS]);
+					sum += e.real();
+				}
+			}
+			bench_sink = sum;
+			break;
+	}
+}
+
+
+/*
+ * lms_step_q15() over the same samples in Q15, with the step BENCH_G
+ * scaled to match, in nanoseconds per sample.  There is no soa version.
+ */
+static double bench_q15_time(const complex16 *s) {
+
+	const unsigned int steps = BENCH_LEN - BENCH_TAPS;
+
+	unsigned int n, runs = 0, shift;
+	int16_t g;
+	int32_t sum;
+	clock_t start, now;
+	complex16 w[BENCH_TAPS];
+
+	q15_step(BENCH_G / (32768.0 * 32768.0), &g, &shift);
+	start = clock();
+	do {
+		memset(w, 0, sizeof(w));
+		sum = 0;
+		for(n = 0; n < steps; n++)
+			sum += lms_step_q15(w, s + n, BENCH_TAPS, g, shift,
+			   s[n + BENCH_TAPS]).i;
+		bench_sink = sum;
+		runs += 1;
+		now = clock();
+	} while((double)(now - start) / CLOCKS_PER_SEC < BENCH_TIME);
+
+	return 1e9 * (now - start) / CLOCKS_PER_SEC / ((double)runs * BENCH_LEN);
+}
+
+
+// nanoseconds per sample
+static double bench_time(int kernel, bool soa, const complex *s, soa_buffer *b) {
+
+	unsigned int runs = 0;
+	clock_t start, now;
+
+	start = clock();
+	do {
+		bench_run(kernel, soa, s, b);
+		runs += 1;
+		now = clock();
+	} while((double)(now - start) / CLOCKS_PER_SEC < BENCH_TIME);
+
+	return 1e9 * (now - start) / CLOCKS_PER_SEC / ((double)runs * BENCH_LEN);
+}
+
+
+/*
+ * Time each kernel in both layouts on this machine and say which wins.
+ * The soa times leave out splitting the samples, which happens once per
+ * capture however many kernels then run over it.
+ */
+void kernel_benchmark() {
+
+	int k;
+	unsigned int n, runs;
+	double t_c, t_soa;
+	clock_t start, now;
+	unsigned char *u;
+	complex *s;
+	complex16 *s16;
+	soa_buffer *b;
+
+	s = new complex[BENCH_LEN];
+	s16 = new complex16[BENCH_LEN];
+	b = new soa_buffer(BENCH_LEN);
+	srand(1);
+	for(n = 0; n < BENCH_LEN; n++) {
+		s16[n].i = (rand() % 255 - 127) * 256;
+		s16[n].q = (rand() % 255 - 127) * 256;
+		s[n] = complex(s16[n].i / 32768.0, s16[n].q / 32768.0);
+	}
+	b->load(s, BENCH_LEN);
+
+	printf("%s kernels\n", kernel_name());
+	printf("kernel\t\tinterleaved\tsoa\t\t(ns/sample)\n");
+	for(k = 0; k < K_COUNT; k++) {
+		t_c = bench_time(k, false, s, b);
+		t_soa = bench_time(k, true, s, b);
+		printf("%-12s\t%8.3f\t%8.3f\t%s\n", bench_name[k], t_c, t_soa,
+		   (t_soa < t_c)? "soa" : "interleaved");
+	}
+	printf("%-12s\t%8.3f\t       -\t(fixed point)\n", "lms_step_q15",
+	   bench_q15_time(s16));
+
+	runs = 0;
+	start = clock();
+	do {
+		b->load(s, BENCH_LEN);
+		runs += 1;
+		now = clock();
+	} while((double)(now - start) / CLOCKS_PER_SEC < BENCH_TIME);
+	printf("splitting into I and Q: %.3f ns/sample\n", 1e9 * (now - start) /
+	   CLOCKS_PER_SEC / ((double)runs * BENCH_LEN));
+
+	u = new unsigned char[2 * BENCH_LEN];
+	for(n = 0; n < 2 * BENCH_LEN; n++)
+		u[n] = rand();
+	runs = 0;
+	start = clock();
+	do {
+		convert_u8(u, BENCH_LEN, s);
+		runs += 1;
+		now = clock();
+	} while((double)(now - start) / CLOCKS_PER_SEC < BENCH_TIME);
+	printf("converting 8-bit samples: %.3f ns/sample\n", 1e9 * (now - start) /
+	   CLOCKS_PER_SEC / ((double)runs * BENCH_LEN));
+
+	delete[] u;
+	delete b;
+	delete[] s16;
+	delete[] s;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The inner loops of the detectors.  Each comes in two layouts, one for
+ * interleaved complex samples and one, suffixed _soa, for samples kept as
+ * separate I and Q arrays (see soa_buffer).  Which is faster depends on the
+ * compiler and the vector unit; kernel_benchmark() times both.
+ *
+ * convert_u8(), norm2(), power_peak(), lms_step() and lms_step_q15() are
+ * dispatched at run time to whichever of the scalar, SSE4.1, AVX2, AVX-512
+ * or NEON versions kernel_select() picked.
+ */
+
+#pragma once
+
+#include "usrp_complex.h"
+
+/*
+ * Pick a set of kernels by name, or the fastest this cpu can run when name
+ * is null.  Call it before starting any threads.
+ */
+int kernel_select(const char *name);
+const char *kernel_name();
+void kernel_list();
+
+// n interleaved 8-bit I/Q pairs, centred on 127, to complex scaled by 256
+void convert_u8(const unsigned char *u, const unsigned int n, complex *c);
+
+// sum of the power of the samples
+double norm2(const complex *s, const unsigned int len);
+double norm2_soa(const float *i, const float *q, const unsigned int len);
+
+// index of the sample with the most power, that power and the total
+unsigned int power_peak(const complex *s, const unsigned int len, float *max, float *sum);
+unsigned int power_peak_soa(const float *i, const float *q, const unsigned int len, float *max, float *sum);
+
+/*
+ * One step of the fcch_detector adaptive filter over the len samples x:
+ * predict d from them with the taps w, update the taps and return the error.
+ */
+complex lms_step(complex *w, const complex *x, const unsigned int len, const float G, const complex d);
+void lms_step_soa(float *w_i, float *w_q, const float *x_i, const float *x_q, const unsigned int len, const float G, const float d_i, const float d_q, float *e_i, float *e_q);
+
+/*
+ * Fixed point versions for complex16 samples.  The power is exact.  The
+ * adaptive filter keeps Q15 taps, rounds each product back to Q15, saturates
+ * the taps, returns the error halved, and steps by g * 2^-shift, which
+ * q15_step() sets from a floating point G.  The NEON version gives the same
+ * bits as the scalar one.
+ */
+int64_t norm2_q15(const complex16 *s, const unsigned int len);
+void q15_step(const double G, int16_t *g, unsigned int *shift);
+complex16 lms_step_q15(complex16 *w, const complex16 *x, const unsigned int len, const int16_t g, const unsigned int shift, const complex16 d);
+
+void kernel_benchmark();
@@ -27,6 +27,7 @@
 
 #include "usrp_source.h"
 #include "fcch_detector.h"
+#include "sch_detector.h"
 #include "util.h"
 
 #ifdef _WIN32
@@ -36,8 +37,21 @@ inline double round(double x) { return floor(x + 0.5); }
 static const unsigned int	AVG_COUNT	= 100;
 static const unsigned int	AVG_THRESHOLD	= (AVG_COUNT / 10);
 static const float		OFFSET_MAX	= 40e3;
+static const unsigned int	INTEGRATE_SLACK	= 2;
+static const unsigned int	REFINE_COUNT	= (AVG_COUNT / 5);
+static const unsigned int	REFINE_ROUNDS	= 4;
 
 extern int g_verbosity;
+extern unsigned int g_fcch_decimation;
+extern int g_fcch_engine;
+extern int g_fcch_gate;
+extern int g_energy_gate;
+extern int g_track;
+extern int g_sch;
+extern unsigned int g_integrate;
+extern double g_pfa;
+extern int g_refine;
+extern int g_soa;
 
 
 int offset_detect(usrp_source *u, int hz_adjust, float tuner_error) {
@@ -45,38 +59,111 @@ int offset_detect(usrp_source *u, int hz_adjust, float tuner_error) {
 #define GSM_RATE (1625000.0 / 6.0)
 
 	unsigned int new_overruns = 0, overruns = 0;
-	int notfound = 0;
-	unsigned int s_len, b_len, consumed, count;
+	int notfound = 0, outside = 0;
+	unsigned int s_len, w_len, skip, b_len, consumed, count, trim, r,
+	   want, rounds;
+	unsigned long long deadline;
 	float offset = 0.0, min = 0.0, max = 0.0, avg_offset = 0.0,
-	   stddev = 0.0, sps, offsets[AVG_COUNT];
-	double total_ppm;
+	   stddev = 0.0, sps, offsets[AVG_COUNT], pm, pm_min, limit;
+	double total_ppm, pos, freq, ppm;
 	complex *cbuf;
 	fcch_detector *l;
+	sch_detector *sch = 0;
 	circular_buffer *cb;
 
-	l = new fcch_detector(u->sample_rate());
-
 	/*
 	 * We deliberately grab 12 frames and 1 burst.  We are guaranteed to
 	 * find at least one FCCH burst in this much data.
 	 */
 	sps = u->sample_rate() / GSM_RATE;
 	s_len = (unsigned int)ceil((12 * 8 * 156.25 + 156.25) * sps);
+
+	// leave room for the SCH after a burst at the end of the capture
+	if(g_sch) {
+		sch = new sch_detector(u->sample_rate());
+		if(sch->set_pfa(g_pfa)) {
+			fprintf(stderr, "error: sch_detector::set_pfa\n");
+			delete sch;
+			return -1;
+		}
+		u->set_capture_len(sch->needed(s_len));
+	} else
+		u->set_capture_len(s_len);
 	cb = u->get_buffer();
+	l = new fcch_detector(u->sample_rate(), cb->buf_len());
+	if(l->set_decimation(g_fcch_decimation)) {
+		fprintf(stderr, "error: fcch_detector::set_decimation\n");
+		return -1;
+	}
+	if(l->set_engine(g_fcch_engine)) {
+		fprintf(stderr, "error: fcch_detector::set_engine\n");
+		return -1;
+	}
+	l->set_gate(g_fcch_gate);
+	if(l->set_zoom(OFFSET_MAX)) {
+		fprintf(stderr, "error: fcch_detector::set_zoom\n");
+		return -1;
+	}
+	if(g_energy_gate)
+		l->set_noise_floor(fcch_detector::NOISE_AUTO);
+	l->set_continuous(g_track || (g_integrate > 1));
+	if(l->set_pfa(g_pfa)) {
+		fprintf(stderr, "error: fcch_detector::set_pfa\n");
+		return -1;
+	}
+	if(l->set_integrate(g_integrate)) {
+		fprintf(stderr, "error: fcch_detector::set_integrate\n");
+		return -1;
+	}
 
 	u->start();
 	u->flush();
+
+	/*
+	 * Integrating is for towers we may barely see, so give up after
+	 * INTEGRATE_SLACK times as long as AVG_COUNT offsets should take and
+	 * make do with what we have.
+	 */
+	deadline = 0;
+	if(g_integrate > 1)
+		deadline = u->sample_count() + (unsigned long long)(INTEGRATE_SLACK *
+		   (AVG_COUNT + 5) * g_integrate * 11 * 1250 * sps);
+
+	/*
+	 * In closed loop mode we apply what a few offsets say the error is
+	 * and measure again, until the correction stops changing.  Both the
+	 * OFFSET_MAX window and the tuner do better near zero offset.
+	 */
+	freq = u->m_center_freq - tuner_error;
+	want = g_refine? REFINE_COUNT : AVG_COUNT;
+	rounds = 0;
+
 	count = 0;
 	while(count < AVG_COUNT) {
+		if(deadline && (u->sample_count() > deadline)) {
+			break;
+		}
 
 		// ensure at least s_len contiguous samples are read from usrp
 		do {
-			if(u->fill(s_len, &new_overruns)) {
+			/*
+			 * When tracking we know where the next burst is.  Skip
+			 * to it and capture just enough to cover it.
+			 */
+			w_len = s_len;
+			if(l->next_window(&skip, &w_len)) {
+				if(u->skip(skip)) {
+					return -1;
+				}
+				l->skip(skip);
+			}
+			if(u->fill(w_len, &new_overruns)) {
 				return -1;
 			}
 			if(new_overruns) {
 				overruns += new_overruns;
 				u->flush();
+				l->reset();
 			}
 		} while(new_overruns);
 
@@ -84,7 +171,35 @@ int offset_detect(usrp_source *u, int hz_adjust, float tuner_error) {
 		cbuf = (complex *)cb->peek(&b_len);
 
 		// search the buffer for a pure tone
-		if(l->scan(cbuf, b_len, &offset, &consumed)) {
+		if(u->fixed())
+			r = l->scan_q15((complex16 *)cbuf, b_len, &offset, &consumed);
+		else if(g_soa)
+			r = l->scan_soa(cbuf, u->get_soa(), b_len, &offset,
+			   &consumed);
+		else
+			r = l->scan(cbuf, b_len, &offset, &consumed);
+
+		// the SCH one frame later must confirm it
+		if(r && sch && (g_integrate < 2)) {
+			if(sch->needed(l->found_at()) > b_len) {
+				if(u->fill(sch->needed(l->found_at()), &new_overruns)) {
+					return -1;
+				}
+				if(new_overruns) {
+					// the SCH isn't where the burst said, start over
+					overruns += new_overruns;
+					u->flush();
+					l->reset();
+					continue;
+				}
+				cbuf = (complex *)cb->peek(&b_len);
+			}
+			r = sch->detect(cbuf, b_len, l->found_at(), &offset, &pos);
+			if(r)
+				l->align(pos);
+		}
+
+		if(r) {
 
 			// FCH is a sine wave at GSM_RATE / 4
 			offset = offset - GSM_RATE / 4 - tuner_error;
@@ -95,35 +210,94 @@ int offset_detect(usrp_source *u, int hz_adjust, float tuner_error) {
 				offsets[count] = offset;
 				count += 1;
 
-				if(g_verbosity > 0) {
+				if(g_verbosity > 1) {
+					l->thresholds(&pm, &pm_min, &limit);
+					fprintf(stderr, "\toffset %3u: %.2f\tpm %.1f > %.1f"
+					   "\tlimit %.2f\n", count, offset, pm,
+					   pm_min, limit);
+				} else if(g_verbosity > 0) {
 					fprintf(stderr, "\toffset %3u: %.2f\n", count, offset);
 				}
+			} else if((++outside >= (int)AVG_COUNT) && !count) {
+				fprintf(stderr, "error: every frequency burst is "
+				   "more than %.0fkHz off, try '-e' or '-W'\n",
+				   OFFSET_MAX / 1e3);
+				delete l;
+				delete sch;
+				return -1;
 			}
-		} else {
+		} else if(g_integrate < 2) {
+			// integrating, most scans are only adding to the sums
 			++notfound;
 		}
 
 		// consume used samples
 		cb->purge(consumed);
+
+		if((count == want) && (want < AVG_COUNT)) {
+			sort(offsets, count);
+			trim = count / 10;
+			avg_offset = avg(offsets + trim, count - 2 * trim, 0);
+			ppm = u->m_freq_corr - ((avg_offset + hz_adjust) / u->m_center_freq) * 1000000;
+			if(((int)round(ppm) == u->m_freq_corr) || (++rounds > REFINE_ROUNDS)) {
+				// close enough, these offsets count
+				want = AVG_COUNT;
+				continue;
+			}
+			if(g_verbosity > 0) {
+				fprintf(stderr, "correction %d ppm -> %d ppm\n",
+				   u->m_freq_corr, (int)round(ppm));
+			}
+			if(u->set_freq_correction((int)round(ppm)) < 0) {
+				fprintf(stderr, "error: usrp_source::set_freq_correction\n");
+				return -1;
+			}
+			if(!u->tune(freq + hz_adjust)) {
+				fprintf(stderr, "error: usrp_source::tune\n");
+				return -1;
+			}
+			tuner_error = u->m_center_freq - freq;
+			u->flush();
+			l->reset();
+			count = 0;
+		}
 	}
 
 	u->stop();
-	delete l;
+
+	if(!count) {
+		fprintf(stderr, "error: no frequency bursts found\n");
+		delete l;
+		delete sch;
+		return -1;
+	}
 
 	// construct stats
-	sort(offsets, AVG_COUNT);
-	avg_offset = avg(offsets + AVG_THRESHOLD, AVG_COUNT - 2 * AVG_THRESHOLD, &stddev);
-	min = offsets[AVG_THRESHOLD];
-	max = offsets[AVG_COUNT - AVG_THRESHOLD - 1];
+	trim = (count == AVG_COUNT)? AVG_THRESHOLD : count / 10;
+	sort(offsets, count);
+	avg_offset = avg(offsets + trim, count - 2 * trim, &stddev);
+	min = offsets[trim];
+	max = offsets[count - trim - 1];
 
 	printf("average\t\t[min, max]\t(range, stddev)\n");
 	display_freq(avg_offset);
 	printf("\t\t[%d, %d]\t(%d, %f)\n", (int)round(min), (int)round(max), (int)round(max - min), stddev);
 	printf("overruns: %u\n", overruns);
 	printf("not found: %u\n", notfound);
+	if(count < AVG_COUNT)
+		printf("offsets: %u\n", count);
+	if(g_verbosity > 0) {
+		fprintf(stderr, "skipped %.1f%% of the samples received\n",
+		   100.0 * u->skip_count() / u->sample_count());
+	}
 
 	total_ppm = u->m_freq_corr - ((avg_offset + hz_adjust) / u->m_center_freq) * 1000000;
 
 	printf("average absolute error: %.3f ppm\n", total_ppm);
+
+	l->print_compare();
+	delete l;
+	delete sch;
+
 	return 0;
 }
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "power_sum.h"
+#include "kernels.h"
+
+// samples per norm2() call when adding a block
+static const unsigned int	BLOCK	= 256;
+
+
+/*
+ * Add a block of samples.  norm2() sums each BLOCK of them with the vector
+ * unit and only the block sums go through the compensation.
+ */
+void power_sum::add(const complex *s, const unsigned int len) {
+
+	unsigned int n;
+
+	for(n = 0; n + BLOCK <= len; n += BLOCK)
+		add(norm2(s + n, BLOCK));
+	if(n < len)
+		add(norm2(s + n, len - n));
+}
+
+
+power_prefix::power_prefix(const unsigned int max_len) {
+
+	m_max_len = max_len;
+	m_len = 0;
+	m_p = new double[max_len + 1];
+	m_p[0] = 0.0;
+}
+
+
+power_prefix::~power_prefix() {
+
+	delete[] m_p;
+}
+
+
+// m_p[n] is the power of the first n samples of s
+void power_prefix::load(const complex *s, const unsigned int len) {
+
+	unsigned int n;
+	power_sum sum;
+
+	m_len = (len < m_max_len)? len : m_max_len;
+	for(n = 0; n < m_len; n++) {
+		sum.add(norm(s[n]));
+		m_p[n + 1] = sum.value();
+	}
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sample power over windows.  power_sum keeps a running sum that samples
+ * can be added to and taken out of, compensated (Kahan) so that it doesn't
+ * drift however long it slides.  power_prefix holds the prefix sums of a
+ * capture, after which the power of any window of it is one subtraction.
+ */
+
+#pragma once
+
+#include "usrp_complex.h"
+
+class power_sum {
+
+public:
+	power_sum() { reset(); };
+	void reset() { m_sum = m_c = 0.0; };
+
+	// take a sample out by adding the negative of its power
+	void add(const double p) {
+
+		double y = p - m_c, t = m_sum + y;
+
+		m_c = (t - m_sum) - y;
+		m_sum = t;
+	};
+	void add(const complex *s, const unsigned int len);
+	double value() const { return m_sum - m_c; };
+
+private:
+	double	m_sum,
+		m_c;
+};
+
+
+class power_prefix {
+
+public:
+	power_prefix(const unsigned int max_len);
+	~power_prefix();
+	void load(const complex *s, const unsigned int len);
+	unsigned int len() { return m_len; };
+
+	// power of the len samples from start
+	double window(const unsigned int start, const unsigned int len) const {
+
+		return m_p[start + len] - m_p[start];
+	};
+
+private:
+	unsigned int	m_max_len,
+			m_len;
+	double		*m_p;
+};
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>	// for debug
+#include <stdlib.h>
+
+#include <stdexcept>
+#include <string.h>
+#include "sch_detector.h"
+
+extern int g_debug;
+
+/*
+ * GSM 05.02 extended training sequence of the synchronization burst.
+ */
+static const unsigned char sync_bits[64] = {
+	1, 0, 1, 1, 1, 0, 0, 1, 0, 1, 1, 0, 0, 0, 1, 0,
+	0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+	0, 0, 1, 0, 1, 1, 0, 1, 0, 1, 0, 0, 0, 1, 0, 1,
+	0, 1, 1, 1, 0, 1, 1, 0, 0, 0, 0, 1, 1, 0, 1, 1
+};
+
+/*
+ * Normalized correlation a synchronization burst must reach without a
+ * target false alarm rate (see set_pfa()), symbols of uncertainty past the
+ * reported frequency burst position, and symbols trimmed from each end of
+ * the frequency burst before re-estimating the offset over it.
+ */
+static const float		SCH_MIN_CORR	= 0.35;
+static const unsigned int	SCH_SLACK	= 16;
+static const unsigned int	FCCH_TRIM	= 6;
+
+
+/*
+ * The reference is the sync sequence, less its first bit which only sets
+ * the phase of the second, modulated as MSK.  GMSK is close enough to
+ * find the burst.
+ */
+sch_detector::sch_detector(const float sample_rate) {
+
+	unsigned int n, k;
+	double sym, phase = 0.0, inc;
+
+	m_sample_rate = sample_rate;
+	m_sps = sample_rate / GSM_RATE;
+	m_fcch_burst_len = (unsigned int)(148.0 * m_sps);
+	m_r_len = (unsigned int)((SYNC_LEN - 1) * m_sps);
+	m_corr = 0.0;
+	m_min_corr = SCH_MIN_CORR;
+
+	if(!(m_r = new complex[m_r_len])) {
+		fprintf(stderr, "error: new\n");
+		throw std::runtime_error("error: new");
+	}
+	if(!(m_w = new complex[m_r_len])) {
+		fprintf(stderr, "error: new\n");
+		throw std::runtime_error("error: new");
+	}
+	if(!(m_a = new float[m_r_len])) {
+		fprintf(stderr, "error: new\n");
+		throw std::runtime_error("error: new");
+	}
+	if(!(m_z = new complex[m_fcch_burst_len])) {
+		fprintf(stderr, "error: new\n");
+		throw std::runtime_error("error: new");
+	}
+
+	k = 1;
+	inc = (1 - 2 * (sync_bits[1] ^ sync_bits[0])) * M_PI / 2;
+	for(n = 0; n < m_r_len; n++) {
+		sym = 1.0 + n / m_sps;
+		while((unsigned int)sym > k) {
+			phase += inc;
+			k += 1;
+			inc = (1 - 2 * (sync_bits[k] ^ sync_bits[k - 1])) * M_PI / 2;
+		}
+		m_r[n] = complex(cos(phase + inc * (sym - k)),
+		   sin(phase + inc * (sym - k)));
+		m_a[n] = (inc > 0)? 1.0 : -1.0;
+	}
+}
+
+
+sch_detector::~sch_detector() {
+
+	delete[] m_r;
+	delete[] m_w;
+	delete[] m_z;
+	delete[] m_a;
+}
+
+
+/*
+ * After a false frequency burst, what we correlate against is most likely
+ * traffic.  MSK traffic against the MSK reference gives a real correlation,
+ * so over the N = SYNC_LEN - 1 symbols of the reference it reaches a
+ * normalized correlation of c about as often as a normal variable passes
+ * sqrt(N c), and the best of the K positions searched reaches c with
+ * probability at most
+ *
+ * 	K * exp(-N * c / 2)
+ *
+ * SCH_MIN_CORR holds that to 3e-3 (1.2e-4 measured on random traffic).
+ * With a target false alarm rate pfa this check gets sqrt(pfa), the same
+ * share as each stage of fcch_detector.  0 goes back to SCH_MIN_CORR.
+ */
+int sch_detector::set_pfa(double pfa) {
+
+	const double N = SYNC_LEN - 1;
+	const double K = 148 + 2 * SCH_SLACK + 1;
+
+	double c;
+
+	if((pfa < 0.0) || (pfa >= 1.0))
+		return -1;
+	if(pfa <= 0.0) {
+		m_min_corr = SCH_MIN_CORR;
+		return 0;
+	}
+	c = 2.0 * log(K / sqrt(pfa)) / N;
+	if(c >= 1.0)
+		return -1;
+	m_min_corr = c;
+
+	return 0;
+}
+
+
+/*
+ * How much of s detect() needs, given where fcch_detector found the
+ * frequency burst.
+ */
+unsigned int sch_detector::needed(const unsigned int fcch_pos) {
+
+	return fcch_pos + (unsigned int)((1250 + SYNC_START + 1 + SCH_SLACK) *
+	   m_sps) + m_r_len + 2;
+}
+
+
+/*
+ * Residual frequency of a tone near 0 Hz, from a least squares fit of a
+ * line to its phase about the mean.
+ */
+static double residual(const complex *z, const unsigned int z_len, const float sample_rate) {
+
+	unsigned int n;
+	double x, sxx = 0.0, sxy = 0.0;
+	complex c = 0.0;
+
+	for(n = 0; n < z_len; n++)
+		c += z[n];
+	if(abs(c) == 0.0)
+		return 0.0;
+	c /= abs(c);
+	for(n = 0; n < z_len; n++) {
+		x = n - 0.5 * (z_len - 1);
+		sxx += x * x;
+		sxy += x * arg(z[n] * conj(c));
+	}
+
+	return sxy / sxx * sample_rate / (2.0 * M_PI);
+}
+
+
+/*
+ * Solve the 3x3 system m x = b by Cramer's rule.
+ */
+static int solve3(double m[3][3], const double b[3], double x[3]) {
+
+	unsigned int i, k;
+	double d, t[3][3];
+
+	d = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+	   m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+	   m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	if(fabs(d) < 1e-12)
+		return 0;
+	for(k = 0; k < 3; k++) {
+		memcpy(t, m, sizeof(t));
+		for(i = 0; i < 3; i++)
+			t[i][k] = b[i];
+		x[k] = (t[0][0] * (t[1][1] * t[2][2] - t[1][2] * t[2][1]) -
+		   t[0][1] * (t[1][0] * t[2][2] - t[1][2] * t[2][0]) +
+		   t[0][2] * (t[1][0] * t[2][1] - t[1][1] * t[2][0])) / d;
+	}
+
+	return 1;
+}
+
+
+/*
+ * detect:
+ * 	s holds a frequency burst at about fcch_pos with tone frequency
+ * 	*offset, i.e., GSM_RATE / 4 plus the carrier offset.  Look for the
+ * 	synchronization burst one frame later, allowing for the frequency
+ * 	burst to have started up to a burst before fcch_pos.
+ *
+ * 	If it is there, the sync sequence tells us where the frequency burst
+ * 	started, to a fraction of a sample, and *burst_pos is set to that.
+ * 	*offset is then re-estimated over the whole frequency burst instead of
+ * 	the part fcch_detector happened to pick.  The sync sequence gives an
+ * 	offset estimate of its own but at 63 symbols it is far noisier than
+ * 	the 136 of the frequency burst, so it is only used for debugging.
+ */
+unsigned int sch_detector::detect(const complex *s, const unsigned int s_len, const unsigned int fcch_pos, float *offset, double *burst_pos) {
+
+	const double lead = (1250 + SYNC_START + 1) * m_sps;
+	unsigned int i, j, n, t, lo, hi, best_t = 0, f_start, f_len;
+	double fo, r_e = 0.0, x_e, rho, best = 0.0, e, m[3][3], b[3], v[3],
+	   delta, df_s, df_f, b_pos;
+	complex c;
+
+	m_corr = 0.0;
+	if(!offset)
+		return 0;
+	fo = *offset - GSM_RATE / 4;
+
+	// search window for the start of the reference
+	lo = fcch_pos + (unsigned int)(lead - (148 + SCH_SLACK) * m_sps);
+	hi = fcch_pos + (unsigned int)(lead + SCH_SLACK * m_sps);
+	if(hi + m_r_len > s_len)
+		return 0;
+
+	// fold the carrier offset into the conjugated reference
+	for(n = 0; n < m_r_len; n++) {
+		m_w[n] = conj(m_r[n]) * complex(cos(-2.0 * M_PI * fo * n / m_sample_rate),
+		   sin(-2.0 * M_PI * fo * n / m_sample_rate));
+		r_e += norm(m_r[n]);
+	}
+
+	for(t = lo; t <= hi; t++) {
+		c = 0.0;
+		x_e = 0.0;
+		for(n = 0; n < m_r_len; n++) {
+			c += s[t + n] * m_w[n];
+			x_e += norm(s[t + n]);
+		}
+		rho = (x_e > 0.0)? norm(c) / (x_e * r_e) : 0.0;
+		if(rho > best) {
+			best = rho;
+			best_t = t;
+		}
+	}
+	m_corr = best;
+
+	if(g_debug)
+		printf("debug: sch: %d\t%f\n", (int)best_t - (int)(fcch_pos + lead), best);
+
+	if(best < m_min_corr)
+		return 0;
+
+	/*
+	 * Fit the phase of the received sync sequence, less the reference,
+	 * to u + v n + g a[n], where a[n] is the sign of the reference's
+	 * phase slope.  v is what is left of the carrier offset.  A timing
+	 * error of d samples turns the reference's phase slope into a phase
+	 * error of -a[n] (pi / 2) d / sps, so g gives the fraction of a
+	 * sample that the correlation peak can't.  Left out of the fit, g
+	 * biases v whenever the two halves of the sequence have different
+	 * numbers of ones.
+	 */
+	c = 0.0;
+	for(n = 0; n < m_r_len; n++)
+		c += s[best_t + n] * m_w[n];
+	c /= abs(c);
+	memset(m, 0, sizeof(m));
+	memset(b, 0, sizeof(b));
+	for(n = 0; n < m_r_len; n++) {
+		v[0] = 1.0;
+		v[1] = n - 0.5 * m_r_len;
+		v[2] = m_a[n];
+		e = arg(s[best_t + n] * m_w[n] * conj(c));
+		for(i = 0; i < 3; i++) {
+			for(j = 0; j < 3; j++)
+				m[i][j] += v[i] * v[j];
+			b[i] += v[i] * e;
+		}
+	}
+	if(!solve3(m, b, v))
+		return 0;
+	df_s = v[1] * m_sample_rate / (2.0 * M_PI);
+	delta = -v[2] * m_sps / (M_PI / 2.0);
+	if(fabs(delta) > 1.0)
+		delta = 0.0;
+
+	b_pos = best_t + delta - lead;
+	if(burst_pos)
+		*burst_pos = b_pos;
+
+	// the frequency burst, if we have all of it
+	df_f = 0.0;
+	if(b_pos >= FCCH_TRIM * m_sps) {
+		f_start = (unsigned int)(b_pos + FCCH_TRIM * m_sps);
+		f_len = m_fcch_burst_len - (unsigned int)(2 * FCCH_TRIM * m_sps);
+		for(n = 0; n < f_len; n++)
+			m_z[n] = s[f_start + n] * complex(cos(-2.0 * M_PI * *offset * n / m_sample_rate),
+			   sin(-2.0 * M_PI * *offset * n / m_sample_rate));
+		df_f = residual(m_z, f_len, m_sample_rate);
+		*offset += df_f;
+	}
+
+	if(g_debug)
+		printf("debug: sch: fcch %f\tsch %f\n", df_f, df_s);
+
+	return 1;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * The synchronization burst follows each frequency burst by one frame and
+ * carries the 64-bit extended training sequence.  Correlating against it
+ * confirms a frequency burst found by fcch_detector and gives its exact
+ * position, and with that a better look at the carrier offset.
+ */
+
+#include "usrp_complex.h"
+
+class sch_detector {
+
+public:
+	sch_detector(const float sample_rate);
+	~sch_detector();
+	int set_pfa(double pfa);
+	unsigned int needed(const unsigned int fcch_pos);
+	unsigned int detect(const complex *s, const unsigned int s_len, const unsigned int fcch_pos, float *offset, double *burst_pos = 0);
+	float corr() { return m_corr; };
+
+private:
+#define GSM_RATE (1625000.0 / 6.0)
+
+	// sync sequence length and where it starts in its burst
+	static const unsigned int	SYNC_LEN	= 64;
+	static const unsigned int	SYNC_START	= 42;
+
+	unsigned int	m_r_len,
+			m_fcch_burst_len;
+	float		m_sample_rate,
+			m_sps,
+			m_corr,
+			m_min_corr,
+			*m_a;
+	complex		*m_r,
+			*m_w,
+			*m_z;
+};
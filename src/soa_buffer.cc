@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2010, Joshua Lackey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *     *  Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     *  Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "soa_buffer.h"
+
+
+soa_buffer::soa_buffer(const unsigned int max_len) {
+
+	m_max_len = max_len;
+	m_len = 0;
+	m_i = new float[max_len];
+	m_q = new float[max_len];
+}
+
+
+soa_buffer::~soa_buffer() {
+
+	delete[] m_i;
+	delete[] m_q;
+}
+
+
+/*
+ * Split up to max_len() samples of s into the I and Q arrays.  Returns how
+ * many were taken.
+ */
+unsigned int soa_buffer::load(const complex *s, const unsigned int s_len) {
+
+	unsigned int n;
+
+	m_len = (s_len < m_max_len)? s_len : m_max_len;
+	for(n = 0; n < m_len; n++) {
+		m_i[n] = s[n].real();
+		m_q[n] = s[n].imag();
+	}
+
+	return m_len;
+}
+
+
+// interleave the len() samples back into s
+void soa_buffer::store(complex *s) {
+
+	unsigned int n;
+
+	for(n = 0; n < m_len; n++)
+		s[n] = complex(m_i[n], m_q[n]);
+}
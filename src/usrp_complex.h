@@ -25,7 +25,24 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#pragma once
+
 #include <complex>
+#include <stdint.h>
 
 typedef std::complex<float> complex;
 
+/*
+ * The fixed point path keeps samples as 16-bit fractions of full scale
+ * (Q15), the dongle's 8 bits in the top byte.
+ */
+struct complex16 {
+	int16_t	i,
+		q;
+};
+
+static inline int16_t sat16(const int32_t x) {
+
+	return (x > 32767)? 32767 : ((x < -32768)? -32768 : x);
+}
+
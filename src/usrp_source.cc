@@ -42,9 +42,15 @@
 #include <complex>
 
 #include "usrp_source.h"
+#include "kernels.h"
 
 extern int g_verbosity;
 
+#define USB_PACKET_SIZE		(2 * 16384)
+#define LOW_MEMORY_PACKET_SIZE	(16 * 512)
+#define FLUSH_SIZE		512
+#define GSM_RATE		(1625000.0 / 6.0)
+
 
 #ifdef _WIN32
 inline double round(double x) { return floor(x + 0.5); }
@@ -56,29 +62,67 @@ usrp_source::usrp_source(float sample_rate, long int fpga_master_clock_freq) {
 	m_desired_sample_rate = sample_rate;
 	m_center_freq = 0.0;
 	m_sample_rate = 0.0;
-	m_decimation = 0;
-	m_cb = new circular_buffer(CB_LEN, sizeof(complex), 0);
+	m_decimation = 1;
+	m_fir = 0;
+	m_fir_in = 0;
+	m_iq = 0;
+	m_iq_balance = true;
+	m_offset_tune = false;
+	m_nco_offset = 0.0;
+	m_nco_phase = 0;
+	m_serial[0] = 0;
+	m_gain_count = 0;
+	m_gain_cache_len = 0;
+	m_cb = 0;
+	m_cb_len = CB_LEN;
+	m_soa_on = false;
+	m_soa = 0;
+	m_fixed = false;
+	m_packet_size = USB_PACKET_SIZE;
 	m_freq_corr = 0;
+	m_sample_count = 0;
+	m_skip_count = 0;
+	m_tune_count = 0;
+	m_settle_len = -1;
 
 	pthread_mutex_init(&m_u_mutex, 0);
+
+	calculate_decimation();
 }
 
 
 usrp_source::usrp_source(unsigned int decimation, long int fpga_master_clock_freq) {
 
 	m_fpga_master_clock_freq = fpga_master_clock_freq;
+	m_desired_sample_rate = GSM_RATE;
 	m_center_freq = 0.0;
 	m_sample_rate = 0.0;
-	m_cb = new circular_buffer(CB_LEN, sizeof(complex), 0);
+	m_fir = 0;
+	m_fir_in = 0;
+	m_iq = 0;
+	m_iq_balance = true;
+	m_offset_tune = false;
+	m_nco_offset = 0.0;
+	m_nco_phase = 0;
+	m_serial[0] = 0;
+	m_gain_count = 0;
+	m_gain_cache_len = 0;
+	m_cb = 0;
+	m_cb_len = CB_LEN;
+	m_soa_on = false;
+	m_soa = 0;
+	m_fixed = false;
+	m_packet_size = USB_PACKET_SIZE;
 	m_freq_corr = 0;
+	m_sample_count = 0;
+	m_skip_count = 0;
+	m_tune_count = 0;
+	m_settle_len = -1;
 
 	pthread_mutex_init(&m_u_mutex, 0);
 
-	m_decimation = decimation & ~1;
-	if(m_decimation < 4)
-		m_decimation = 4;
-	if(m_decimation > 256)
-		m_decimation = 256;
+	m_decimation = decimation;
+	calculate_decimation();
 }
 
 
@@ -86,6 +130,10 @@ usrp_source::~usrp_source() {
 
 	stop();
 	delete m_cb;
+	delete m_soa;
+	delete m_fir;
+	delete[] m_fir_in;
+	delete m_iq;
 	rtlsdr_close(dev);
 	pthread_mutex_destroy(&m_u_mutex);
 }
@@ -105,17 +153,23 @@ void usrp_source::start() {
 }
 
 
+/*
+ * m_decimation is how many times faster than m_desired_sample_rate we ask the
+ * device for samples.  The RTL2832 lets a lot through near the edges of its
+ * band, so capturing faster and filtering down ourselves keeps the
+ * neighbouring channels out.  Move it to the nearest rate the device
+ * supports; 1 captures at the desired rate directly.
+ */
 void usrp_source::calculate_decimation() {
 
-	float decimation_f;
-
-//	decimation_f = (float)m_u_rx->fpga_master_clock_freq() / m_desired_sample_rate;
-	m_decimation = (unsigned int)round(decimation_f) & ~1;
-
-	if(m_decimation < 4)
-		m_decimation = 4;
-	if(m_decimation > 256)
-		m_decimation = 256;
+	if(m_decimation < 1)
+		m_decimation = 1;
+	if(m_decimation == 1)
+		return;
+	if(m_decimation * m_desired_sample_rate < RTL_RATE_MIN)
+		m_decimation = (unsigned int)ceil(RTL_RATE_MIN / m_desired_sample_rate);
+	if(m_decimation * m_desired_sample_rate > RTL_RATE_MAX)
+		m_decimation = (unsigned int)floor(RTL_RATE_MAX / m_desired_sample_rate);
 }
 
 
@@ -132,12 +186,17 @@ int usrp_source::tune(double freq) {
 
 	pthread_mutex_lock(&m_u_mutex);
 	if (freq != m_center_freq) {
-		r = rtlsdr_set_center_freq(dev, (uint32_t)freq);
+		r = rtlsdr_set_center_freq(dev, (uint32_t)round(freq + m_nco_offset));
 
 		if (r < 0)
 			fprintf(stderr, "Tuning to %u Hz failed!\n", (uint32_t)freq);
 		else
-			m_center_freq = rtlsdr_get_center_freq(dev);
+			m_center_freq = rtlsdr_get_center_freq(dev) - m_nco_offset;
+		m_tune_count = m_sample_count;
+
+		// the DC offset moves with the tuner
+		if(m_iq)
+			m_iq->reset();
 	}
 
 	pthread_mutex_unlock(&m_u_mutex);
@@ -178,15 +237,368 @@ bool usrp_source::set_gain(float gain) {
 }
 
 
+int usrp_source::read_packet(unsigned char *ubuf, int *n_read) {
+
+	pthread_mutex_lock(&m_u_mutex);
+	if (rtlsdr_read_sync(dev, ubuf, m_packet_size, n_read) < 0) {
+		pthread_mutex_unlock(&m_u_mutex);
+		fprintf(stderr, "error: usrp_standard_rx::read\n");
+		return -1;
+	}
+	pthread_mutex_unlock(&m_u_mutex);
+
+	return 0;
+}
+
+
+/*
+ * Sit at a low gain SETTLE_STEP away from freq long enough to flush the
+ * pipeline, then switch to gain and tune to freq in one go.  Samples from
+ * before the retune are much weaker than those after, and a tuner that is
+ * still locking looks nothing like one that has.  Returns the device samples
+ * received before the power settled, or SETTLE_MAX when it never did.
+ */
+unsigned int usrp_source::settle_trial(double freq, int gain) {
+
+	unsigned char ubuf[USB_PACKET_SIZE];
+	unsigned int n, i, j, b, nb, run;
+	int n_read;
+	double p[SETTLE_MAX / SETTLE_BLOCK], sorted[SETTLE_MAX / SETTLE_BLOCK],
+	   t, ref;
+
+	rtlsdr_set_tuner_gain(dev, m_gains[0]);
+	rtlsdr_set_center_freq(dev, (uint32_t)(freq + SETTLE_STEP));
+	for(n = 0; n < SETTLE_MAX; n += n_read / 2) {
+		if(read_packet(ubuf, &n_read))
+			return SETTLE_MAX;
+	}
+
+	rtlsdr_set_tuner_gain(dev, gain);
+	rtlsdr_set_center_freq(dev, (uint32_t)freq);
+	nb = 0;
+	b = 0;
+	t = 0.0;
+	for(n = 0; n < SETTLE_MAX; n += n_read / 2) {
+		if(read_packet(ubuf, &n_read))
+			return SETTLE_MAX;
+		for(i = 0; i + 1 < (unsigned int)n_read; i += 2) {
+			t += (ubuf[i] - 127.5) * (ubuf[i] - 127.5) +
+			   (ubuf[i + 1] - 127.5) * (ubuf[i + 1] - 127.5);
+			if(++b == SETTLE_BLOCK) {
+				if(nb < SETTLE_MAX / SETTLE_BLOCK)
+					p[nb++] = t;
+				t = 0.0;
+				b = 0;
+			}
+		}
+	}
+
+	if(nb < 8)
+		return SETTLE_MAX;
+
+	// where the power ends up: median of the last quarter
+	for(i = 0; i < nb / 4; i++) {
+		sorted[i] = p[nb - nb / 4 + i];
+		for(j = i; (j > 0) && (sorted[j - 1] > sorted[j]); j--) {
+			t = sorted[j];
+			sorted[j] = sorted[j - 1];
+			sorted[j - 1] = t;
+		}
+	}
+	ref = sorted[nb / 8];
+
+	run = 0;
+	for(i = 0; i < nb; i++) {
+		if((p[i] > ref / 2) && (p[i] < ref * 2)) {
+			if(++run == SETTLE_RUN)
+				return (i + 1 - SETTLE_RUN) * SETTLE_BLOCK;
+		} else
+			run = 0;
+	}
+
+	return SETTLE_MAX;
+}
+
+
+/*
+ * Measure how many samples after a retune are stale or still settling, so
+ * flush() drops exactly those.  The count depends on the device rate and
+ * serials are not unique, so the result is kept per serial number and rate
+ * in $HOME/.kal_settle_<serial>_<rate> and only measured when forced.
+ * Without a stored result, or a serial to store it under, flush() keeps
+ * dropping its fixed amount.
+ */
+int usrp_source::calibrate_settle(double freq, bool force) {
+
+	char name[1024];
+	const char *home = getenv("HOME");
+	unsigned int i, len, worst;
+	FILE *fp;
+
+	if(!m_serial[0]) {
+		if(force)
+			fprintf(stderr, "warning: device has no serial number, "
+			   "keeping the fixed flush\n");
+		return -1;
+	}
+
+	name[0] = 0;
+	if(home && (strlen(home) + strlen(m_serial) + 26 < sizeof(name)))
+		sprintf(name, "%s/.kal_settle_%s_%u", home, m_serial,
+		   (unsigned int)round(m_sample_rate * m_decimation));
+
+	if(!force) {
+		if(!name[0] || !(fp = fopen(name, "r")))
+			return -1;
+		if(fscanf(fp, "%d", &m_settle_len) != 1)
+			m_settle_len = -1;
+		fclose(fp);
+		return (m_settle_len >= 0)? 0 : -1;
+	}
+
+	if(!m_gain_count) {
+		m_gain_count = rtlsdr_get_tuner_gains(dev, 0);
+		if((m_gain_count < 2) || (m_gain_count > AGC_GAINS_MAX)) {
+			m_gain_count = 0;
+			return -1;
+		}
+		rtlsdr_get_tuner_gains(dev, m_gains);
+	}
+
+	fprintf(stderr, "Calibrating tuner settle time...\n");
+	pthread_mutex_lock(&m_u_mutex);
+	rtlsdr_set_tuner_gain_mode(dev, 1);
+	pthread_mutex_unlock(&m_u_mutex);
+
+	worst = 0;
+	for(i = 0; i < SETTLE_TRIALS; i++) {
+		len = settle_trial(freq, m_gains[m_gain_count / 2]);
+		if(g_verbosity > 1)
+			fprintf(stderr, "\tsettle trial %u: %u samples\n", i, len);
+		if(len > worst)
+			worst = len;
+	}
+
+	pthread_mutex_lock(&m_u_mutex);
+	rtlsdr_set_tuner_gain_mode(dev, 0);
+	pthread_mutex_unlock(&m_u_mutex);
+	m_center_freq = 0.0;
+
+	if(worst >= SETTLE_MAX) {
+		fprintf(stderr, "warning: tuner never settled, keeping the "
+		   "fixed flush\n");
+		return -1;
+	}
+	m_settle_len = worst + SETTLE_BLOCK;
+	fprintf(stderr, "Tuner settles in %d samples\n", m_settle_len);
+
+	if(name[0] && (fp = fopen(name, "w"))) {
+		fprintf(fp, "%d\n", m_settle_len);
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Largest distance from the middle of the 8-bit range that more than
+ * 1 in AGC_TAIL of the next AGC_SAMPLES sample components reach.  These
+ * are read straight from the device and don't go into the buffer.
+ */
+int usrp_source::peak_level(unsigned int *level) {
+
+	unsigned char ubuf[USB_PACKET_SIZE];
+	unsigned int hist[128], i, n, total, tail;
+	int n_read;
+
+	memset(hist, 0, sizeof(hist));
+	total = 0;
+	for(n = 0; n < AGC_SETTLE + AGC_SAMPLES; n += n_read / 2) {
+		if(read_packet(ubuf, &n_read))
+			return -1;
+
+		if(n < AGC_SETTLE)
+			continue;
+		for(i = 0; i < (unsigned int)n_read; i++)
+			hist[(ubuf[i] < 128)? 127 - ubuf[i] : ubuf[i] - 128]++;
+		total += n_read;
+	}
+
+	tail = 0;
+	for(i = 127; i > 0; i--) {
+		tail += hist[i];
+		if(tail * AGC_TAIL > total)
+			break;
+	}
+	*level = i;
+
+	return 0;
+}
+
+
+/*
+ * Choose the highest tuner gain that keeps the samples clear of the ends of
+ * the 8-bit range at the current frequency.  The gain is monotonic in the
+ * level, so we bisect the tuner's gains, starting from the one that worked
+ * here last time, if any.  Returns the gain in tenths of a dB or -1.
+ */
+int usrp_source::auto_gain() {
+
+	int lo, hi, mid, cached = -1, g;
+	unsigned int i, khz, level;
+
+	if(!m_gain_count) {
+		m_gain_count = rtlsdr_get_tuner_gains(dev, 0);
+		if((m_gain_count <= 0) || (m_gain_count > AGC_GAINS_MAX)) {
+			m_gain_count = 0;
+			fprintf(stderr, "error: rtlsdr_get_tuner_gains\n");
+			return -1;
+		}
+		rtlsdr_get_tuner_gains(dev, m_gains);
+		load_gain_cache();
+	}
+
+	if(rtlsdr_set_tuner_gain_mode(dev, 1) < 0)
+		fprintf(stderr, "WARNING: Failed to enable manual gain.\n");
+
+	khz = (unsigned int)round(m_center_freq / 1e3);
+	for(i = 0; i < m_gain_cache_len; i++) {
+		if(m_gain_cache_khz[i] == khz) {
+			for(g = 0; g < m_gain_count; g++) {
+				if(m_gains[g] == m_gain_cache[i])
+					cached = g;
+			}
+			break;
+		}
+	}
+
+	/*
+	 * Invariant: m_gains[lo] is fine (or lo is -1) and m_gains[hi] clips
+	 * (or hi is m_gain_count).
+	 */
+	lo = -1;
+	hi = m_gain_count;
+	mid = (cached >= 0)? cached : m_gain_count / 2;
+	while(hi - lo > 1) {
+		pthread_mutex_lock(&m_u_mutex);
+		rtlsdr_set_tuner_gain(dev, m_gains[mid]);
+		pthread_mutex_unlock(&m_u_mutex);
+		if(peak_level(&level))
+			return -1;
+		if(g_verbosity > 2) {
+			fprintf(stderr, "\tgain %.1f dB: level %u\n",
+			   m_gains[mid] / 10.0, level);
+		}
+		if(level < AGC_MAX_LEVEL)
+			lo = mid;
+		else
+			hi = mid;
+
+		// what worked last time probably still does, try one up
+		if((mid == cached) && (lo == cached))
+			mid = cached + 1;
+		else
+			mid = (lo + hi) / 2;
+		if(mid <= lo)
+			mid = lo + 1;
+	}
+	if(lo < 0)
+		lo = 0;
+
+	pthread_mutex_lock(&m_u_mutex);
+	rtlsdr_set_tuner_gain(dev, m_gains[lo]);
+	pthread_mutex_unlock(&m_u_mutex);
+	if(g_verbosity > 0) {
+		fprintf(stderr, "auto gain at %.1fMHz: %.1f dB\n",
+		   m_center_freq / 1e6, m_gains[lo] / 10.0);
+	}
+
+	if((cached < 0) || (m_gains[lo] != m_gains[cached])) {
+		for(i = 0; i < m_gain_cache_len; i++) {
+			if(m_gain_cache_khz[i] == khz)
+				break;
+		}
+		if(i < AGC_CACHE_MAX) {
+			m_gain_cache_khz[i] = khz;
+			m_gain_cache[i] = m_gains[lo];
+			if(i == m_gain_cache_len)
+				m_gain_cache_len++;
+			save_gain_cache();
+		}
+	}
+
+	return m_gains[lo];
+}
+
+
+/*
+ * The gains auto_gain() picked are kept per device serial number in
+ * $HOME/.kal_gain_<serial>, one "kHz gain" pair per line.
+ */
+void usrp_source::load_gain_cache() {
+
+	char name[1024];
+	const char *home = getenv("HOME");
+	FILE *fp;
+
+	m_gain_cache_len = 0;
+	if(!home || !m_serial[0] ||
+	   (strlen(home) + strlen(m_serial) + 12 > sizeof(name)))
+		return;
+	sprintf(name, "%s/.kal_gain_%s", home, m_serial);
+	if(!(fp = fopen(name, "r")))
+		return;
+	while((m_gain_cache_len < AGC_CACHE_MAX) && (fscanf(fp, "%u %d",
+	   &m_gain_cache_khz[m_gain_cache_len],
+	   &m_gain_cache[m_gain_cache_len]) == 2))
+		m_gain_cache_len++;
+	fclose(fp);
+}
+
+
+void usrp_source::save_gain_cache() {
+
+	char name[1024];
+	const char *home = getenv("HOME");
+	unsigned int i;
+	FILE *fp;
+
+	if(!home || !m_serial[0] ||
+	   (strlen(home) + strlen(m_serial) + 12 > sizeof(name)))
+		return;
+	sprintf(name, "%s/.kal_gain_%s", home, m_serial);
+	if(!(fp = fopen(name, "w")))
+		return;
+	for(i = 0; i < m_gain_cache_len; i++)
+		fprintf(fp, "%u %d\n", m_gain_cache_khz[i], m_gain_cache[i]);
+	fclose(fp);
+}
+
+
 /*
  * open() should be called before multiple threads access usrp_source.
  */
 int usrp_source::open(unsigned int subdev) {
 	int i, r, device_count, count;
 	uint32_t dev_index = subdev;
-	uint32_t samp_rate = 270833;
-
-	m_sample_rate = 270833.002142;
+	uint32_t samp_rate, ratio;
+
+	/*
+	 * The device divides its crystal down to the nearest rate it can make,
+	 * which is what we really get.  For 270833 Hz that is 270833.002142 Hz.
+	 */
+	samp_rate = (uint32_t)round(m_desired_sample_rate * m_decimation);
+	ratio = (uint32_t)((double)RTL_XTAL * (1 << 22) / samp_rate) & 0x0ffffffc;
+	ratio |= (ratio & 0x08000000) << 1;
+	m_sample_rate = (double)RTL_XTAL * (1 << 22) / ratio / m_decimation;
+
+	// the fixed point path has no filter or mixer
+	if(m_fixed && (m_decimation > 1)) {
+		fprintf(stderr, "error: fixed point samples can't be "
+		   "decimated\n");
+		return -1;
+	}
 
 	device_count = rtlsdr_get_device_count();
 	if (!device_count) {
@@ -209,6 +621,41 @@ int usrp_source::open(unsigned int subdev) {
 		exit(1);
 	}
 
+	if(!m_cb)
+		m_cb = new circular_buffer(m_cb_len, sample_size(), 0);
+	soa_init();
+
+	if(rtlsdr_get_device_usb_strings(dev_index, 0, 0, m_serial) < 0)
+		m_serial[0] = 0;
+
+	if(m_iq_balance)
+		m_iq = new iq_balance();
+
+	/*
+	 * Offset tuning keeps the channel clear of the DC spike.  When we
+	 * capture faster than we need, we do it ourselves: tune a quarter of
+	 * the capture rate high and mix back down, which is just a rotation
+	 * by j per sample, and the decimating filter takes out the spike.
+	 * Otherwise we ask the tuner, which only the E4000 can do.
+	 */
+	if(m_offset_tune) {
+		if(m_decimation > 1) {
+			m_nco_offset = m_sample_rate * m_decimation / 4;
+		} else if(rtlsdr_set_offset_tuning(dev, 1) < 0) {
+			fprintf(stderr, "WARNING: Failed to enable offset tuning, "
+			   "try it with -r\n");
+		}
+	}
+
+	if(m_decimation > 1) {
+		m_fir = new fir_decimator(m_decimation, USB_PACKET_SIZE / 2);
+		m_fir_in = new complex[USB_PACKET_SIZE / 2];
+		if(g_verbosity > 0) {
+			fprintf(stderr, "capturing at %u Hz, decimating by %u\n",
+			   samp_rate, m_decimation);
+		}
+	}
+
 	/* Set the sample rate */
 	r = rtlsdr_set_sample_rate(dev, samp_rate);
 	if (r < 0)
@@ -219,30 +666,25 @@ int usrp_source::open(unsigned int subdev) {
 	if (r < 0)
 		fprintf(stderr, "WARNING: Failed to reset buffers.\n");
 
-//	r = rtlsdr_set_offset_tuning(dev, 1);
-//	if (r < 0)
-//		fprintf(stderr, "WARNING: Failed to enable offset tuning\n");
-
 	return 0;
 }
 
-#define USB_PACKET_SIZE		(2 * 16384)
-#define FLUSH_SIZE		512
-
 
 int usrp_source::fill(unsigned int num_samples, unsigned int *overrun_i) {
 
 	unsigned char ubuf[USB_PACKET_SIZE];
-	unsigned int i, j, space, overruns = 0;
-	complex *c;
+	unsigned int i, space, overruns = 0;
+	void *c;
 	int n_read;
 
-	while((m_cb->data_available() < num_samples) && (m_cb->space_available() > 0)) {
+	// only read a packet if all of it fits in the buffer
+	while((m_cb->data_available() < num_samples) &&
+	   (m_cb->space_available() >= packet_len())) {
 
 		// read one usb packet from the usrp
 		pthread_mutex_lock(&m_u_mutex);
 
-		if (rtlsdr_read_sync(dev, ubuf, sizeof(ubuf), &n_read) < 0) {
+		if (rtlsdr_read_sync(dev, ubuf, m_packet_size, &n_read) < 0) {
 			pthread_mutex_unlock(&m_u_mutex);
 			fprintf(stderr, "error: usrp_standard_rx::read\n");
 			return -1;
@@ -251,21 +693,18 @@ int usrp_source::fill(unsigned int num_samples, unsigned int *overrun_i) {
 		pthread_mutex_unlock(&m_u_mutex);
 
 		// write complex<short> input to complex<float> output
-		c = (complex *)m_cb->poke(&space);
-
-		// set space to number of complex items to copy
-		space = n_read / 2;
+		c = m_cb->poke(&space);
 
 		// write data
-		for(i = 0, j = 0; i < space; i += 1, j += 2)
-			c[i] = complex((ubuf[j] - 127) * 256, (ubuf[j + 1] - 127) * 256);
+		i = store(ubuf, n_read / 2, 0, c);
+		m_sample_count += i;
 
 		// update cb
 		m_cb->wrote(i);
 	}
 
 	// if the cb is full, we left behind data from the usb packet
-	if(m_cb->space_available() == 0) {
+	if(m_cb->data_available() < num_samples) {
 		fprintf(stderr, "warning: local overrun\n");
 		overruns++;
 	}
@@ -277,6 +716,94 @@ int usrp_source::fill(unsigned int num_samples, unsigned int *overrun_i) {
 }
 
 
+/*
+ * Shift the stream down by a quarter of the capture rate, i.e., multiply
+ * sample k by j^k.
+ */
+void usrp_source::mix(complex *c, unsigned int n) {
+
+	static const complex rot[4] = {
+		complex(1, 0), complex(0, 1), complex(-1, 0), complex(0, -1)
+	};
+	unsigned int i;
+
+	for(i = 0; i < n; i++)
+		c[i] *= rot[(m_nco_phase + i) & 3];
+	m_nco_phase = (m_nco_phase + n) & 3;
+}
+
+
+/*
+ * Convert the 8-bit samples of a USB packet from sample first on, take out
+ * the DC offset and IQ imbalance and, when decimating, filter them down.  Returns the samples written to c.
+ */
+unsigned int usrp_source::convert(const unsigned char *ubuf, unsigned int n,
+   unsigned int first, complex *c) {
+
+	unsigned int i = (first < n)? n - first : 0;
+	complex *d = m_fir? m_fir_in : c;
+
+	convert_u8(ubuf + 2 * first, i, d);
+
+	if(m_iq)
+		m_iq->process(d, i);
+	if(m_nco_offset != 0.0)
+		mix(d, i);
+
+	if(m_fir && (d != c))
+		return m_fir->filter(m_fir_in, i, c);
+	return i;
+}
+
+
+/*
+ * convert() for the fixed point path: the 8-bit samples go into the top
+ * byte of Q15 and the DC offset and IQ imbalance come out in integers.
+ */
+unsigned int usrp_source::convert16(const unsigned char *ubuf, unsigned int n,
+   unsigned int first, complex16 *c) {
+
+	unsigned int i, j;
+
+	for(i = 0, j = 2 * first; first + i < n; i += 1, j += 2) {
+		c[i].i = sat16((ubuf[j] - 127) * 256);
+		c[i].q = sat16((ubuf[j + 1] - 127) * 256);
+	}
+	if(m_iq)
+		m_iq->process(c, i);
+
+	return i;
+}
+
+
+// convert into the buffer in whichever format it holds
+unsigned int usrp_source::store(const unsigned char *ubuf, unsigned int n,
+   unsigned int first, void *c) {
+
+	if(m_fixed)
+		return convert16(ubuf, n, first, (complex16 *)c);
+	return convert(ubuf, n, first, (complex *)c);
+}
+
+
+/*
+ * Size of a sample in the buffer.
+ */
+unsigned int usrp_source::sample_size() {
+
+	return m_fixed? sizeof(complex16) : sizeof(complex);
+}
+
+
+/*
+ * Most samples one USB packet puts in the buffer.
+ */
+unsigned int usrp_source::packet_len() {
+
+	return (m_packet_size / 2 + m_decimation - 1) / m_decimation;
+}
+
+
 int usrp_source::read(complex *buf, unsigned int num_samples,
    unsigned int *samples_read) {
 
@@ -294,6 +821,180 @@ int usrp_source::read(complex *buf, unsigned int num_samples,
 }
 
 
+/*
+ * Drop the next num_samples samples of the stream: first whatever is in the
+ * buffer, then whole USB packets, which are never converted or stored.  The
+ * rest of the last packet is kept.
+ */
+int usrp_source::skip(unsigned int num_samples) {
+
+	unsigned char ubuf[USB_PACKET_SIZE];
+	unsigned int n, o, space;
+	void *c;
+	int n_read;
+
+	num_samples -= m_cb->purge(num_samples);
+	while(num_samples) {
+
+		pthread_mutex_lock(&m_u_mutex);
+
+		if (rtlsdr_read_sync(dev, ubuf, m_packet_size, &n_read) < 0) {
+			pthread_mutex_unlock(&m_u_mutex);
+			fprintf(stderr, "error: usrp_standard_rx::read\n");
+			return -1;
+		}
+
+		pthread_mutex_unlock(&m_u_mutex);
+
+		n = n_read / 2;
+		o = m_fir? m_fir->out_len(n) : n;
+		m_sample_count += o;
+		if(o <= num_samples) {
+			// the filter still has to see what we drop
+			if(m_fir) {
+				convert(ubuf, n, 0, m_fir_in);
+				m_fir->skip(m_fir_in, n);
+			}
+			m_skip_count += o;
+			num_samples -= o;
+			continue;
+		}
+
+		// the buffer is empty so the rest of the packet fits
+		c = m_cb->poke(&space);
+		if(m_fir) {
+			m_cb->wrote(store(ubuf, n, 0, c));
+			m_cb->purge(num_samples);
+		} else
+			m_cb->wrote(store(ubuf, n, num_samples, c));
+		m_skip_count += num_samples;
+		num_samples = 0;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Samples received from the device since open(), and how many of them
+ * skip() dropped without converting.
+ */
+unsigned long long usrp_source::sample_count() {
+
+	return m_sample_count;
+}
+
+
+unsigned long long usrp_source::skip_count() {
+
+	return m_skip_count;
+}
+
+
+/*
+ * Size the sample buffer to hold num_samples plus the USB packet that
+ * completes them, instead of the generic CB_LEN.  Any samples already in the
+ * buffer are dropped.
+ */
+int usrp_source::set_capture_len(unsigned int num_samples) {
+
+	m_cb_len = num_samples + packet_len();
+	if(m_cb) {
+		delete m_cb;
+		m_cb = new circular_buffer(m_cb_len, sample_size(), 0);
+		soa_init();
+	}
+
+	return 0;
+}
+
+
+/*
+ * Keep the channel away from the DC spike.  Call before open().
+ */
+void usrp_source::set_offset_tuning(bool enable) {
+
+	m_offset_tune = enable;
+}
+
+
+/*
+ * Take out the DC offset and IQ imbalance of each sample.  On by default.
+ * Call before open().
+ */
+void usrp_source::set_iq_balance(bool enable) {
+
+	m_iq_balance = enable;
+}
+
+
+/*
+ * Low-memory profile: read smaller USB packets so that the sample buffer
+ * needs less headroom past the capture length.  Call before
+ * set_capture_len().
+ */
+void usrp_source::set_low_memory(bool enable) {
+
+	m_packet_size = enable? LOW_MEMORY_PACKET_SIZE : USB_PACKET_SIZE;
+}
+
+
+/*
+ * Keep samples as complex16 rather than complex, which halves the memory
+ * they take and that the detectors read.  Call before open().
+ */
+void usrp_source::set_fixed(bool enable) {
+
+	m_fixed = enable;
+}
+
+
+/*
+ * Keep room for the buffered samples as separate I and Q arrays, for
+ * get_soa().
+ */
+void usrp_source::set_soa(bool enable) {
+
+	m_soa_on = enable;
+	if(m_cb)
+		soa_init();
+}
+
+
+/*
+ * Size the I and Q arrays to the sample buffer.  Done whenever the buffer is
+ * made so that fill() doesn't allocate while a scan is running.
+ */
+void usrp_source::soa_init() {
+
+	if((!m_soa_on) || m_fixed)
+		return;
+	if((!m_soa) || (m_soa->max_len() < m_cb->buf_len())) {
+		delete m_soa;
+		m_soa = new soa_buffer(m_cb->buf_len());
+	}
+}
+
+
+/*
+ * The samples get_buffer() holds now, split into I and Q.  They are split
+ * on each call rather than on every fill(), so call it once per capture.
+ * 0 unless set_soa() was called.
+ */
+soa_buffer *usrp_source::get_soa() {
+
+	unsigned int len;
+	void *c;
+
+	if(!m_soa)
+		return 0;
+	c = m_cb->peek(&len);
+	m_soa->load((const complex *)c, len);
+
+	return m_soa;
+}
+
+
 /*
  * Don't hold a lock on this and use the usrp at the same time.
  */
@@ -303,9 +1004,22 @@ circular_buffer *usrp_source::get_buffer() {
 }
 
 
+/*
+ * Drop what is buffered and, once calibrate_settle() has measured the
+ * tuner, exactly the samples up to where it settled after the last retune.
+ * Otherwise drop flush_count * FLUSH_SIZE samples and hope that was enough.
+ */
 int usrp_source::flush(unsigned int flush_count) {
 
+	unsigned long long settled;
+
 	m_cb->flush();
+	if((m_settle_len >= 0) && (flush_count == FLUSH_COUNT)) {
+		settled = m_tune_count + m_settle_len / m_decimation;
+		if(settled > m_sample_count)
+			return skip(settled - m_sample_count);
+		return 0;
+	}
 	fill(flush_count * FLUSH_SIZE, 0);
 	m_cb->flush();
 
@@ -29,6 +29,9 @@
 
 #include "usrp_complex.h"
 #include "circular_buffer.h"
+#include "fir_decimator.h"
+#include "iq_balance.h"
+#include "soa_buffer.h"
 
 
 class usrp_source {
@@ -40,15 +43,30 @@ public:
 	int open(unsigned int subdev);
 	int read(complex *buf, unsigned int num_samples, unsigned int *samples_read);
 	int fill(unsigned int num_samples, unsigned int *overrun);
+	int skip(unsigned int num_samples);
 	int tune(double freq);
 	int set_freq_correction(int ppm);
 	bool set_antenna(int antenna);
 	bool set_gain(float gain);
+	int auto_gain();
+	int calibrate_settle(double freq, bool force = false);
 	bool set_dithering(bool enable);
 	void start();
 	void stop();
 	int flush(unsigned int flush_count = FLUSH_COUNT);
+	int set_capture_len(unsigned int num_samples);
+	void set_low_memory(bool enable);
+	void set_offset_tuning(bool enable);
+	void set_iq_balance(bool enable);
 	circular_buffer *get_buffer();
+	void set_soa(bool enable);
+	void set_fixed(bool enable);
+	bool fixed() { return m_fixed; };
+	unsigned int sample_size();
+	soa_buffer *get_soa();
+	unsigned long long sample_count();
+	unsigned long long skip_count();
+	unsigned long long tune_count() { return m_tune_count; };
 
 	float sample_rate();
 
@@ -60,16 +78,89 @@ public:
 
 private:
 	void calculate_decimation();
+	unsigned int packet_len();
+	unsigned int convert(const unsigned char *ubuf, unsigned int n, unsigned int first, complex *c);
+	unsigned int convert16(const unsigned char *ubuf, unsigned int n, unsigned int first, complex16 *c);
+	unsigned int store(const unsigned char *ubuf, unsigned int n, unsigned int first, void *c);
+	void mix(complex *c, unsigned int n);
+	void soa_init();
+	int read_packet(unsigned char *ubuf, int *n_read);
+	int peak_level(unsigned int *level);
+	unsigned int settle_trial(double freq, int gain);
+	void load_gain_cache();
+	void save_gain_cache();
 
 	rtlsdr_dev_t		*dev;
 
 	float			m_sample_rate;
 	float			m_desired_sample_rate;
 	unsigned int		m_decimation;
+	fir_decimator *		m_fir;
+	complex *		m_fir_in;
+	iq_balance *		m_iq;
+	bool			m_iq_balance;
+
+	// tune this far above the channel and mix it back down
+	bool			m_offset_tune;
+	double			m_nco_offset;
+	unsigned int		m_nco_phase;
+
+	/*
+	 * auto_gain() looks at AGC_SAMPLES samples, after dropping AGC_SETTLE
+	 * samples captured before the gain changed.  Gains are fine while
+	 * no more than 1 in AGC_TAIL sample components are AGC_MAX_LEVEL or
+	 * more from the middle of the 8-bit range.
+	 */
+	static const unsigned int	AGC_SAMPLES	= 65536;
+	static const unsigned int	AGC_SETTLE	= 16384;
+	static const unsigned int	AGC_TAIL	= 1000;
+	static const unsigned int	AGC_MAX_LEVEL	= 115;
+	static const int		AGC_GAINS_MAX	= 64;
+	static const unsigned int	AGC_CACHE_MAX	= 1024;
+
+	// the tuner's gains and the ones auto_gain() picked before
+	char			m_serial[256];
+	int			m_gains[AGC_GAINS_MAX];
+	int			m_gain_count;
+	unsigned int		m_gain_cache_len;
+	unsigned int		m_gain_cache_khz[AGC_CACHE_MAX];
+	int			m_gain_cache[AGC_CACHE_MAX];
 
 	long int		m_fpga_master_clock_freq;
 
 	circular_buffer *	m_cb;
+	unsigned int		m_cb_len;
+
+	// the buffered samples again as separate I and Q arrays
+	bool			m_soa_on;
+	soa_buffer *		m_soa;
+
+	// the buffer holds complex16 rather than complex
+	bool			m_fixed;
+	unsigned int		m_packet_size;
+
+	unsigned long long	m_sample_count;
+	unsigned long long	m_skip_count;
+
+	/*
+	 * m_sample_count at the last retune, and how many device samples
+	 * after it are stale or still settling (-1 when not calibrated).
+	 */
+	unsigned long long	m_tune_count;
+	int			m_settle_len;
+
+	/*
+	 * calibrate_settle() retunes SETTLE_TRIALS times and watches the
+	 * power of SETTLE_BLOCK sample blocks for SETTLE_MAX samples.  The
+	 * tuner has settled once SETTLE_RUN blocks in a row are within a
+	 * factor of 2 of where the power ends up.  Frequencies alternate
+	 * SETTLE_STEP apart.
+	 */
+	static const unsigned int	SETTLE_TRIALS	= 6;
+	static const unsigned int	SETTLE_BLOCK	= 256;
+	static const unsigned int	SETTLE_MAX	= 262144;
+	static const unsigned int	SETTLE_RUN	= 16;
+	static const unsigned int	SETTLE_STEP	= 2000000;
 
 	/*
 	 * This mutex protects access to the USRP and daughterboards but not
@@ -77,6 +168,11 @@ private:
 	 */
 	pthread_mutex_t		m_u_mutex;
 
+	// the RTL2832 resampler's rates and its crystal
+	static const unsigned int	RTL_RATE_MIN	= 900001;
+	static const unsigned int	RTL_RATE_MAX	= 3200000;
+	static const unsigned int	RTL_XTAL	= 28800000;
+
 	static const unsigned int	FLUSH_COUNT	= 10;
 	static const unsigned int	CB_LEN		= (16 * 16384);
 	static const int		NCHAN		= 1;